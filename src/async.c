@@ -0,0 +1,898 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emq.h"
+#include "async.h"
+#include "network.h"
+#include "protocol.h"
+#include "packet.h"
+#include "internal.h"
+
+#define EMQ_ASYNC_STATE_HEADER 0
+#define EMQ_ASYNC_STATE_BODY 1
+
+static emq_async_context *emq_async_context_create(emq_client *client)
+{
+	emq_async_context *context;
+
+	context = (emq_async_context*)calloc(1, sizeof(*context));
+	if (!context) {
+		return NULL;
+	}
+
+	context->client = client;
+	context->output = (char*)malloc(EMQ_DEFAULT_ASYNC_OUTPUT_SIZE);
+	context->output_size = EMQ_DEFAULT_ASYNC_OUTPUT_SIZE;
+	context->replies = (emq_async_reply*)malloc(sizeof(emq_async_reply) * EMQ_DEFAULT_ASYNC_REPLIES);
+	context->replies_size = EMQ_DEFAULT_ASYNC_REPLIES;
+	context->state = EMQ_ASYNC_STATE_HEADER;
+
+	if (!context->output || !context->replies) {
+		free(context->output);
+		free(context->replies);
+		free(context);
+		return NULL;
+	}
+
+	return context;
+}
+
+static void emq_async_context_release(emq_async_context *context)
+{
+	free(context->output);
+	free(context->replies);
+	free(context);
+}
+
+static emq_async_context *emq_async_init(emq_client *client)
+{
+	emq_async_context *context;
+
+	if (!client) {
+		return NULL;
+	}
+
+	context = emq_async_attach(client);
+	if (!context) {
+		emq_disconnect(client);
+		return NULL;
+	}
+
+	return context;
+}
+
+emq_async_context *emq_async_tcp_connect(const char *addr, int port)
+{
+	return emq_async_init(emq_tcp_connect(addr, port));
+}
+
+emq_async_context *emq_async_unix_connect(const char *path)
+{
+	return emq_async_init(emq_unix_connect(path));
+}
+
+/* The client belongs to the caller, on error it is left as it was */
+emq_async_context *emq_async_attach(emq_client *client)
+{
+	emq_async_context *context;
+
+	if (emq_client_set_nonblock(client, 1) == EMQ_NET_ERR) {
+		return NULL;
+	}
+
+	context = emq_async_context_create(client);
+	if (!context) {
+		emq_client_set_nonblock(client, 0);
+		return NULL;
+	}
+
+	return context;
+}
+
+static int emq_async_reply_push(emq_async_context *context, uint8_t cmd, const char *name,
+	const char *topic, emq_async_callback *callback, void *data)
+{
+	emq_async_reply *replies, *reply;
+	size_t i;
+
+	if (context->replies_count == context->replies_size) {
+		replies = (emq_async_reply*)malloc(sizeof(emq_async_reply) * context->replies_size * 2);
+		if (!replies) {
+			return EMQ_STATUS_ERR;
+		}
+
+		for (i = 0; i < context->replies_count; i++) {
+			replies[i] = context->replies[(context->replies_head + i) % context->replies_size];
+		}
+
+		free(context->replies);
+		context->replies = replies;
+		context->replies_size *= 2;
+		context->replies_head = 0;
+	}
+
+	reply = &context->replies[(context->replies_head + context->replies_count) % context->replies_size];
+
+	reply->cmd = cmd;
+	reply->callback = callback;
+	reply->data = data;
+
+	if (name) {
+		memcpy(reply->name, name, strlen(name) + 1);
+	}
+
+	if (topic) {
+		memcpy(reply->topic, topic, strlen(topic) + 1);
+	}
+
+	context->replies_count++;
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_async_reply_pop(emq_async_context *context, emq_async_reply *reply)
+{
+	if (!context->replies_count) {
+		return EMQ_STATUS_ERR;
+	}
+
+	*reply = context->replies[context->replies_head];
+
+	context->replies_head = (context->replies_head + 1) % context->replies_size;
+	context->replies_count--;
+
+	return EMQ_STATUS_OK;
+}
+
+void emq_async_disconnect(emq_async_context *context)
+{
+	emq_async_reply reply;
+
+	if (context == NULL) {
+		return;
+	}
+
+	if (context->ev.cleanup) {
+		context->ev.cleanup(context->ev.data);
+	}
+
+	while (emq_async_reply_pop(context, &reply) == EMQ_STATUS_OK)
+	{
+		if (reply.callback) {
+			reply.callback(context, EMQ_ERROR_READ, NULL, reply.data);
+		}
+	}
+
+	emq_disconnect(context->client);
+	emq_async_context_release(context);
+}
+
+int emq_async_fd(emq_async_context *context)
+{
+	return context->client->fd;
+}
+
+emq_client *emq_async_client(emq_async_context *context)
+{
+	return context->client;
+}
+
+int emq_async_want_write(emq_async_context *context)
+{
+	return context->output_len > context->output_pos;
+}
+
+static int emq_async_append(emq_async_context *context, const void *buf, size_t size)
+{
+	size_t new_size;
+	char *output;
+
+	if (context->output_pos && context->output_len + size > context->output_size) {
+		memmove(context->output, context->output + context->output_pos,
+			context->output_len - context->output_pos);
+		context->output_len -= context->output_pos;
+		context->output_pos = 0;
+	}
+
+	if (context->output_len + size > context->output_size) {
+		new_size = context->output_size * 2;
+		while (new_size < context->output_len + size) {
+			new_size *= 2;
+		}
+
+		output = (char*)realloc(context->output, new_size);
+		if (!output) {
+			return EMQ_STATUS_ERR;
+		}
+
+		context->output = output;
+		context->output_size = new_size;
+	}
+
+	memcpy(context->output + context->output_len, buf, size);
+	context->output_len += size;
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_async_send(emq_async_context *context, uint8_t cmd, void *extra, size_t extra_size,
+	emq_msg *msg, const char *name, const char *topic, emq_async_callback *callback, void *data)
+{
+	emq_client *client = context->client;
+	size_t pos = context->output_pos;
+	size_t len = context->output_len;
+	struct iovec iov[EMQ_MSG_IOV_MAX];
+	int iovcnt = 0;
+	int i;
+
+	if (emq_async_append(context, client->request, client->pos) == EMQ_STATUS_ERR) {
+		goto error;
+	}
+
+	if (extra_size && emq_async_append(context, extra, extra_size) == EMQ_STATUS_ERR) {
+		goto error;
+	}
+
+	if (msg) {
+		iovcnt = emq_msg_iov(msg, iov);
+	}
+
+	for (i = 0; i < iovcnt; i++)
+	{
+		if (emq_async_append(context, iov[i].iov_base, iov[i].iov_len) == EMQ_STATUS_ERR) {
+			goto error;
+		}
+	}
+
+	if (!client->noack) {
+		if (emq_async_reply_push(context, cmd, name, topic, callback, data) == EMQ_STATUS_ERR) {
+			goto error;
+		}
+	}
+
+	if (pos == len && context->ev.add_write) {
+		context->ev.add_write(context->ev.data);
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	if (context->output_pos == pos) {
+		context->output_len = len;
+	} else {
+		context->output_len = len - pos;
+	}
+
+	emq_client_set_error(client, EMQ_ERROR_ALLOC);
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+static int emq_async_request_error(emq_async_context *context)
+{
+	emq_client_set_error(context->client, EMQ_ERROR_DATA);
+	EMQ_SET_STATUS(context->client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_async_auth(emq_async_context *context, const char *name, const char *password,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_auth_request(context->client, name, password) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_AUTH, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_ping(emq_async_context *context, emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_ping_request(context->client) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_PING, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_declare(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_queue_declare_request(context->client, name) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_DECLARE, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_push(emq_async_context *context, const char *name, emq_msg *msg,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (msg->size < 1) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_queue_push_request(context->client, name, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_PUSH, &msg->expire, sizeof(msg->expire),
+		msg, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_get(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_queue_get_request(context->client, name) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_GET, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_pop(emq_async_context *context, const char *name, emq_time timeout,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_queue_pop_request(context->client, name, timeout) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_POP, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_confirm(emq_async_context *context, const char *name, emq_tag tag,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_queue_confirm_request(context->client, name, tag) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_CONFIRM, NULL, 0, NULL, NULL, NULL, callback, data);
+}
+
+int emq_async_queue_subscribe(emq_async_context *context, const char *name, uint32_t flags,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data)
+{
+	emq_client *client = context->client;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (!msg_callback) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_queue_subscribe_request(client, name, flags) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_queue_subscription_add(client, name, flags, msg_callback) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE, NULL, 0, NULL,
+		name, NULL, callback, data) == EMQ_STATUS_ERR) {
+		emq_queue_subscription_delete(client, name);
+		return EMQ_STATUS_ERR;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_async_queue_unsubscribe(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data)
+{
+	emq_client *client = context->client;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (emq_queue_unsubscribe_request(client, name) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_async_send(context, EMQ_PROTOCOL_CMD_QUEUE_UNSUBSCRIBE, NULL, 0, NULL,
+		name, NULL, callback, data) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (client->noack) {
+		emq_queue_subscription_delete(client, name);
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_async_route_push(emq_async_context *context, const char *name, const char *key, emq_msg *msg,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (msg->size < 1) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_route_push_request(context->client, name, key, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_ROUTE_PUSH, &msg->expire, sizeof(msg->expire),
+		msg, NULL, NULL, callback, data);
+}
+
+int emq_async_channel_publish(emq_async_context *context, const char *name, const char *topic, emq_msg *msg,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (msg->size < 1) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_channel_publish_request(context->client, name, topic, msg->size) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_send(context, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, NULL, 0,
+		msg, NULL, NULL, callback, data);
+}
+
+static int emq_async_channel_add(emq_async_context *context, uint8_t cmd, const char *name,
+	const char *topic, emq_msg_callback *msg_callback, emq_async_callback *callback, void *data)
+{
+	emq_client *client = context->client;
+
+	int pattern = cmd == EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE;
+
+	if (emq_channel_subscription_add(client, name, topic, pattern, msg_callback) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (emq_async_send(context, cmd, NULL, 0, NULL, name, topic, callback, data) == EMQ_STATUS_ERR) {
+		emq_channel_subscription_delete(client, name, topic, pattern);
+		return EMQ_STATUS_ERR;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_async_channel_subscribe(emq_async_context *context, const char *name, const char *topic,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (!msg_callback) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_channel_subscribe_request(context->client, name, topic) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_channel_add(context, EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE, name, topic,
+		msg_callback, callback, data);
+}
+
+int emq_async_channel_psubscribe(emq_async_context *context, const char *name, const char *pattern,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (!msg_callback) {
+		return emq_async_request_error(context);
+	}
+
+	if (emq_channel_psubscribe_request(context->client, name, pattern) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_channel_add(context, EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE, name, pattern,
+		msg_callback, callback, data);
+}
+
+static int emq_async_channel_remove(emq_async_context *context, uint8_t cmd, const char *name,
+	const char *topic, emq_async_callback *callback, void *data)
+{
+	emq_client *client = context->client;
+
+	if (emq_async_send(context, cmd, NULL, 0, NULL, name, topic, callback, data) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (client->noack) {
+		emq_channel_subscription_delete(client, name, topic, cmd == EMQ_PROTOCOL_CMD_CHANNEL_PUNSUBSCRIBE);
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_async_channel_unsubscribe(emq_async_context *context, const char *name, const char *topic,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_channel_unsubscribe_request(context->client, name, topic) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_channel_remove(context, EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE, name, topic,
+		callback, data);
+}
+
+int emq_async_channel_punsubscribe(emq_async_context *context, const char *name, const char *pattern,
+	emq_async_callback *callback, void *data)
+{
+	EMQ_CLEAR_ERROR(context->client);
+
+	if (emq_channel_punsubscribe_request(context->client, name, pattern) == EMQ_STATUS_ERR) {
+		return emq_async_request_error(context);
+	}
+
+	return emq_async_channel_remove(context, EMQ_PROTOCOL_CMD_CHANNEL_PUNSUBSCRIBE, name, pattern,
+		callback, data);
+}
+
+static void emq_async_drain_send(emq_async_context *context, emq_drain *drain);
+
+static void emq_async_drain_callback(emq_async_context *context, int status, emq_msg *msg, void *data)
+{
+	emq_drain *drain = (emq_drain*)data;
+
+	drain->inflight--;
+
+	if (msg) {
+		if (drain->released) {
+			emq_msg_release(msg);
+		} else {
+			emq_queue_deliver(context->client, drain->subscription, msg);
+		}
+	} else {
+		drain->empty = 1;
+
+		if (status != EMQ_ERROR_NO_DATA) {
+			drain->again = 0;
+		}
+	}
+
+	if (drain->inflight) {
+		return;
+	}
+
+	if (drain->released) {
+		free(drain);
+		return;
+	}
+
+	if (!drain->empty || drain->again) {
+		emq_async_drain_send(context, drain);
+	}
+}
+
+static void emq_async_drain_send(emq_async_context *context, emq_drain *drain)
+{
+	size_t i;
+
+	drain->empty = 0;
+	drain->again = 0;
+
+	for (i = 0; i < drain->batch; i++)
+	{
+		if (emq_async_queue_pop(context, drain->subscription->name, drain->timeout,
+			emq_async_drain_callback, drain) == EMQ_STATUS_ERR) {
+			break;
+		}
+
+		drain->inflight++;
+	}
+}
+
+static void emq_async_drain(emq_async_context *context)
+{
+	emq_client *client = context->client;
+	emq_drain *drain;
+
+	while ((drain = client->drains) != NULL)
+	{
+		client->drains = drain->next;
+		drain->next = NULL;
+		drain->pending = 0;
+
+		emq_async_drain_send(context, drain);
+	}
+}
+
+static int emq_async_process_reply(emq_async_context *context, protocol_response_header *header,
+	const char *body)
+{
+	emq_client *client = context->client;
+	emq_async_reply reply;
+	emq_msg *msg = NULL;
+	int status = EMQ_ERROR_NONE;
+	uint64_t tag;
+
+	if (emq_async_reply_pop(context, &reply) == EMQ_STATUS_ERR ||
+		emq_check_response_header_mini(header, reply.cmd) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (emq_check_status(header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		status = emq_get_error(header);
+		if (status == EMQ_ERROR_NONE) {
+			status = EMQ_ERROR_RESPONSE;
+		}
+	}
+
+	switch (reply.cmd)
+	{
+		case EMQ_PROTOCOL_CMD_QUEUE_GET:
+		case EMQ_PROTOCOL_CMD_QUEUE_POP:
+			if (status != EMQ_ERROR_NONE) {
+				break;
+			}
+
+			if (header->bodylen < sizeof(tag)) {
+				emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+				return EMQ_STATUS_ERR;
+			}
+
+			memcpy(&tag, body, sizeof(tag));
+
+			msg = emq_msg_pool_get(client->msg_pool, (void*)(body + sizeof(tag)), header->bodylen - sizeof(tag));
+			if (!msg) {
+				status = EMQ_ERROR_ALLOC;
+				break;
+			}
+
+			msg->tag = tag;
+			break;
+
+		case EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE:
+			if (status != EMQ_ERROR_NONE) {
+				emq_queue_subscription_delete(client, reply.name);
+			}
+			break;
+
+		case EMQ_PROTOCOL_CMD_QUEUE_UNSUBSCRIBE:
+			if (status == EMQ_ERROR_NONE) {
+				emq_queue_subscription_delete(client, reply.name);
+			}
+			break;
+
+		case EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE:
+		case EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE:
+			if (status != EMQ_ERROR_NONE) {
+				emq_channel_subscription_delete(client, reply.name, reply.topic,
+					reply.cmd == EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE);
+			}
+			break;
+
+		case EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE:
+		case EMQ_PROTOCOL_CMD_CHANNEL_PUNSUBSCRIBE:
+			if (status == EMQ_ERROR_NONE) {
+				emq_channel_subscription_delete(client, reply.name, reply.topic,
+					reply.cmd == EMQ_PROTOCOL_CMD_CHANNEL_PUNSUBSCRIBE);
+			}
+			break;
+	}
+
+	if (reply.callback) {
+		reply.callback(context, status, msg, reply.data);
+	} else if (msg) {
+		emq_msg_release(msg);
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_async_process_frame(emq_async_context *context, protocol_response_header *header,
+	const char *body)
+{
+	emq_client *client = context->client;
+
+	switch (header->magic)
+	{
+		case EMQ_PROTOCOL_RES:
+			return emq_async_process_reply(context, header, body);
+
+		case EMQ_PROTOCOL_EVENT:
+			if (emq_check_event_header((protocol_event_header*)header, EMQ_PROTOCOL_EVENT_NOTIFY,
+				EMQ_PROTOCOL_EVENT_MESSAGE) == EMQ_STATUS_ERR) {
+				emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+				return EMQ_STATUS_ERR;
+			}
+
+			if (emq_event_dispatch(client, (protocol_event_header*)header, body) == -1) {
+				return EMQ_STATUS_ERR;
+			}
+
+			return EMQ_STATUS_OK;
+	}
+
+	emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+	return EMQ_STATUS_ERR;
+}
+
+static int emq_async_parse(emq_async_context *context)
+{
+	emq_client *client = context->client;
+	protocol_response_header header;
+	size_t available;
+	const char *body;
+
+	for (;;)
+	{
+		available = client->input_len - client->input_pos;
+
+		if (context->state == EMQ_ASYNC_STATE_HEADER)
+		{
+			if (available < sizeof(header)) {
+				break;
+			}
+
+			memcpy(&header, client->input + client->input_pos, sizeof(header));
+
+			/* the input buffer grows to the whole frame, a broken length must not allocate gigabytes */
+			if (header.bodylen > EMQ_MAX_REQUEST_SIZE) {
+				emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+				return EMQ_STATUS_ERR;
+			}
+
+			memcpy(context->header, &header, sizeof(header));
+			client->input_pos += sizeof(header);
+			context->state = EMQ_ASYNC_STATE_BODY;
+			continue;
+		}
+
+		memcpy(&header, context->header, sizeof(header));
+
+		if (available < header.bodylen) {
+			break;
+		}
+
+		body = client->input + client->input_pos;
+		client->input_pos += header.bodylen;
+		context->state = EMQ_ASYNC_STATE_HEADER;
+
+		if (emq_async_process_frame(context, &header, body) == EMQ_STATUS_ERR) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	if (client->input_pos == client->input_len) {
+		client->input_pos = client->input_len = 0;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static size_t emq_async_need(emq_async_context *context)
+{
+	protocol_response_header header;
+
+	if (context->state == EMQ_ASYNC_STATE_HEADER) {
+		return sizeof(header);
+	}
+
+	memcpy(&header, context->header, sizeof(header));
+
+	return header.bodylen;
+}
+
+int emq_async_handle_read(emq_async_context *context)
+{
+	emq_client *client = context->client;
+	int nread;
+
+	EMQ_CLEAR_ERROR(client);
+
+	for (;;)
+	{
+		nread = emq_client_fill(client, emq_async_need(context));
+
+		if (nread == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_async_parse(context) == EMQ_STATUS_ERR) {
+			goto error;
+		}
+
+		if (nread == 0) {
+			break;
+		}
+	}
+
+	if (client->drains) {
+		emq_async_drain(context);
+	}
+
+	if (client->batches) {
+		emq_batch_flush(client);
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_async_handle_write(emq_async_context *context)
+{
+	emq_client *client = context->client;
+	int nwritten;
+
+	EMQ_CLEAR_ERROR(client);
+
+	while (context->output_pos < context->output_len)
+	{
+		nwritten = emq_client_write_some(client, context->output + context->output_pos,
+			context->output_len - context->output_pos);
+
+		if (nwritten == -1) {
+			emq_client_set_error(client, EMQ_ERROR_WRITE);
+			EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+			return EMQ_STATUS_ERR;
+		}
+
+		if (nwritten == 0) {
+			break;
+		}
+
+		context->output_pos += nwritten;
+	}
+
+	if (context->output_pos == context->output_len) {
+		context->output_pos = context->output_len = 0;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
@@ -0,0 +1,114 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _EMQ_ASYNC_H_
+#define _EMQ_ASYNC_H_
+
+#include "emq.h"
+
+#define EMQ_DEFAULT_ASYNC_OUTPUT_SIZE 16384
+#define EMQ_DEFAULT_ASYNC_REPLIES 64
+
+struct emq_async_context;
+
+typedef void emq_async_callback(struct emq_async_context *context, int status, emq_msg *msg, void *data);
+
+typedef struct emq_async_reply {
+	uint8_t cmd;
+	char name[64];
+	char topic[32];
+	emq_async_callback *callback;
+	void *data;
+} emq_async_reply;
+
+typedef struct emq_async_events {
+	void *data;
+	void (*add_write)(void *data);
+	void (*cleanup)(void *data);
+} emq_async_events;
+
+typedef struct emq_async_context {
+	emq_client *client;
+	char *output;
+	size_t output_size;
+	size_t output_pos;
+	size_t output_len;
+	emq_async_reply *replies;
+	size_t replies_size;
+	size_t replies_head;
+	size_t replies_count;
+	int state;
+	uint8_t header[8];
+	emq_async_events ev;
+	void *data;
+} emq_async_context;
+
+emq_async_context *emq_async_tcp_connect(const char *addr, int port);
+emq_async_context *emq_async_unix_connect(const char *path);
+emq_async_context *emq_async_attach(emq_client *client);
+void emq_async_disconnect(emq_async_context *context);
+
+int emq_async_fd(emq_async_context *context);
+emq_client *emq_async_client(emq_async_context *context);
+int emq_async_want_write(emq_async_context *context);
+int emq_async_handle_read(emq_async_context *context);
+int emq_async_handle_write(emq_async_context *context);
+
+int emq_async_auth(emq_async_context *context, const char *name, const char *password,
+	emq_async_callback *callback, void *data);
+int emq_async_ping(emq_async_context *context, emq_async_callback *callback, void *data);
+
+int emq_async_queue_declare(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data);
+int emq_async_queue_push(emq_async_context *context, const char *name, emq_msg *msg,
+	emq_async_callback *callback, void *data);
+int emq_async_queue_get(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data);
+int emq_async_queue_pop(emq_async_context *context, const char *name, emq_time timeout,
+	emq_async_callback *callback, void *data);
+int emq_async_queue_confirm(emq_async_context *context, const char *name, emq_tag tag,
+	emq_async_callback *callback, void *data);
+int emq_async_queue_subscribe(emq_async_context *context, const char *name, uint32_t flags,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data);
+int emq_async_queue_unsubscribe(emq_async_context *context, const char *name,
+	emq_async_callback *callback, void *data);
+
+int emq_async_route_push(emq_async_context *context, const char *name, const char *key, emq_msg *msg,
+	emq_async_callback *callback, void *data);
+
+int emq_async_channel_publish(emq_async_context *context, const char *name, const char *topic, emq_msg *msg,
+	emq_async_callback *callback, void *data);
+int emq_async_channel_subscribe(emq_async_context *context, const char *name, const char *topic,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data);
+int emq_async_channel_psubscribe(emq_async_context *context, const char *name, const char *pattern,
+	emq_msg_callback *msg_callback, emq_async_callback *callback, void *data);
+int emq_async_channel_unsubscribe(emq_async_context *context, const char *name, const char *topic,
+	emq_async_callback *callback, void *data);
+int emq_async_channel_punsubscribe(emq_async_context *context, const char *name, const char *pattern,
+	emq_async_callback *callback, void *data);
+
+#endif
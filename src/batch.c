@@ -0,0 +1,250 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include "emq.h"
+#include "internal.h"
+
+static void emq_batcher_unlink(emq_batcher *batcher)
+{
+	emq_batcher **link = &batcher->client->batches;
+
+	while (*link) {
+		if (*link == batcher) {
+			*link = batcher->next;
+			break;
+		}
+
+		link = &(*link)->next;
+	}
+
+	batcher->next = NULL;
+	batcher->pending = 0;
+}
+
+static void emq_batcher_reset(emq_batcher *batcher)
+{
+	batcher->batch.count = 0;
+	batcher->batch.bytes = 0;
+}
+
+static int emq_batcher_invoke(emq_batcher *batcher)
+{
+	int status;
+
+	if (batcher->pending) {
+		emq_batcher_unlink(batcher);
+	}
+
+	if (!batcher->batch.count) {
+		return 0;
+	}
+
+	batcher->flushing = 1;
+	status = batcher->callback(batcher->client, &batcher->batch);
+	batcher->flushing = 0;
+
+	emq_batcher_reset(batcher);
+
+	if (batcher->released) {
+		emq_batcher_release(batcher);
+	}
+
+	return status;
+}
+
+int emq_batcher_push(emq_batcher *batcher, const char *topic, emq_msg *msg)
+{
+	size_t index = batcher->batch.count;
+
+	batcher->batch.msgs[index] = msg;
+
+	if (batcher->topics) {
+		strncpy(batcher->topics[index], topic ? topic : "", 32);
+		batcher->topics[index][32] = '\0';
+		batcher->batch.topics[index] = batcher->topics[index];
+	}
+
+	batcher->batch.count++;
+	batcher->batch.bytes += msg->size;
+
+	if (batcher->batch.count >= batcher->max_count ||
+		(batcher->max_bytes && batcher->batch.bytes >= batcher->max_bytes)) {
+		return emq_batcher_invoke(batcher);
+	}
+
+	if (!batcher->pending) {
+		batcher->next = batcher->client->batches;
+		batcher->client->batches = batcher;
+		batcher->pending = 1;
+	}
+
+	return 0;
+}
+
+int emq_batch_flush(emq_client *client)
+{
+	int stop = 0;
+
+	while (client->batches) {
+		if (emq_batcher_invoke(client->batches)) {
+			stop = 1;
+		}
+	}
+
+	return stop && EMQ_DICT_LENGTH(client->queue_subscriptions) == 0;
+}
+
+void emq_batcher_release(emq_batcher *batcher)
+{
+	size_t i;
+
+	if (batcher->pending) {
+		emq_batcher_unlink(batcher);
+	}
+
+	if (batcher->flushing) {
+		batcher->released = 1;
+		return;
+	}
+
+	for (i = 0; i < batcher->batch.count; i++) {
+		emq_msg_release(batcher->batch.msgs[i]);
+	}
+
+	free(batcher->batch.msgs);
+	free(batcher->batch.topics);
+	free(batcher->topics);
+	free(batcher);
+}
+
+static int emq_batcher_setup(emq_client *client, emq_batcher **slot, int type, const char *name,
+	const char *pattern, emq_batch_callback *callback, size_t max_count, size_t max_bytes)
+{
+	emq_batcher *batcher;
+
+	if (*slot) {
+		emq_batcher_invoke(*slot);
+		emq_batcher_release(*slot);
+		*slot = NULL;
+	}
+
+	if (!callback) {
+		return EMQ_STATUS_OK;
+	}
+
+	batcher = (emq_batcher*)calloc(1, sizeof(*batcher));
+	if (!batcher) {
+		return EMQ_STATUS_ERR;
+	}
+
+	batcher->client = client;
+	batcher->callback = callback;
+	batcher->max_count = max_count ? max_count : EMQ_DEFAULT_BATCH_COUNT;
+	batcher->max_bytes = max_bytes;
+
+	batcher->batch.type = type;
+	batcher->batch.name = name;
+	batcher->batch.pattern = pattern;
+
+	batcher->batch.msgs = (emq_msg**)malloc(sizeof(emq_msg*) * batcher->max_count);
+	if (!batcher->batch.msgs) {
+		goto error;
+	}
+
+	if (type == EMQ_CALLBACK_CHANNEL) {
+		batcher->batch.topics = (const char**)malloc(sizeof(char*) * batcher->max_count);
+		batcher->topics = malloc(sizeof(*batcher->topics) * batcher->max_count);
+
+		if (!batcher->batch.topics || !batcher->topics) {
+			goto error;
+		}
+	}
+
+	*slot = batcher;
+
+	return EMQ_STATUS_OK;
+
+error:
+	emq_batcher_release(batcher);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_batch(emq_client *client, const char *name, emq_batch_callback *callback,
+	size_t max_count, size_t max_bytes)
+{
+	emq_queue_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_queue_subscription_find(client, name)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_batcher_setup(client, &subscription->batcher, EMQ_CALLBACK_QUEUE, subscription->name, NULL,
+		callback, max_count, max_bytes) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_channel_batch(emq_client *client, const char *name, const char *topic, emq_batch_callback *callback,
+	size_t max_count, size_t max_bytes)
+{
+	emq_channel_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_channel_subscription_get(client, name, topic)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_batcher_setup(client, &subscription->batcher, EMQ_CALLBACK_CHANNEL, subscription->name,
+		(subscription->pattern ? subscription->channel : NULL), callback, max_count, max_bytes) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
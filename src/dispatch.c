@@ -0,0 +1,578 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "emq.h"
+#include "dispatch.h"
+#include "network.h"
+#include "protocol.h"
+#include "internal.h"
+
+#define strlenz(str) (strlen(str) + 1)
+
+#define EMQ_DISPATCH_SPIN 64
+
+#define EMQ_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define EMQ_ATOMIC_STORE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_SEQ_CST)
+
+/* Callbacks submitted and completed, waited for on a condition instead of spinning */
+typedef struct emq_dispatch_counter {
+	size_t submitted;
+	size_t completed;
+	int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} emq_dispatch_counter;
+
+/* The state of a client attached to a dispatcher */
+typedef struct emq_dispatch_client {
+	emq_dispatcher *dispatcher;
+	emq_client *client;
+	emq_dispatch_counter counter;
+	pthread_mutex_t lock;
+	protocol_request_queue_confirm *confirms;
+	size_t confirm_count;
+	size_t confirm_capacity;
+} emq_dispatch_client;
+
+typedef struct emq_dispatch_job {
+	emq_dispatch_client *owner;
+	emq_msg_callback *callback;
+	int type;
+	int flags;
+	char name[64];
+	char topic[33];
+	char pattern[33];
+	emq_msg *msg;
+} emq_dispatch_job;
+
+#define EMQ_DISPATCH_JOB_TOPIC 1
+#define EMQ_DISPATCH_JOB_PATTERN 2
+
+typedef struct emq_dispatch_cell {
+	size_t sequence;
+	emq_dispatch_job job;
+} emq_dispatch_cell;
+
+/* bounded multi-producer ring, consumed by a single worker */
+typedef struct emq_dispatch_worker {
+	emq_dispatch_cell *cells;
+	size_t mask;
+	size_t head;
+	char pad[64];
+	size_t tail;
+	int sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	struct emq_dispatcher *dispatcher;
+} emq_dispatch_worker;
+
+struct emq_dispatcher {
+	emq_dispatch_worker *workers;
+	int count;
+	int stop;
+	emq_dispatch_counter counter;
+};
+
+static pthread_once_t emq_dispatch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t emq_dispatch_current;
+
+static void emq_dispatch_key_create(void)
+{
+	pthread_key_create(&emq_dispatch_current, NULL);
+}
+
+static void emq_dispatch_counter_init(emq_dispatch_counter *counter)
+{
+	counter->submitted = 0;
+	counter->completed = 0;
+	counter->waiting = 0;
+
+	pthread_mutex_init(&counter->lock, NULL);
+	pthread_cond_init(&counter->cond, NULL);
+}
+
+static void emq_dispatch_counter_destroy(emq_dispatch_counter *counter)
+{
+	pthread_mutex_destroy(&counter->lock);
+	pthread_cond_destroy(&counter->cond);
+}
+
+static void emq_dispatch_counter_done(emq_dispatch_counter *counter)
+{
+	__atomic_add_fetch(&counter->completed, 1, __ATOMIC_SEQ_CST);
+
+	if (EMQ_ATOMIC_LOAD(&counter->waiting)) {
+		pthread_mutex_lock(&counter->lock);
+		pthread_cond_broadcast(&counter->cond);
+		pthread_mutex_unlock(&counter->lock);
+	}
+}
+
+static void emq_dispatch_counter_wait(emq_dispatch_counter *counter)
+{
+	pthread_mutex_lock(&counter->lock);
+	__atomic_add_fetch(&counter->waiting, 1, __ATOMIC_SEQ_CST);
+
+	while (EMQ_ATOMIC_LOAD(&counter->completed) != EMQ_ATOMIC_LOAD(&counter->submitted)) {
+		pthread_cond_wait(&counter->cond, &counter->lock);
+	}
+
+	__atomic_sub_fetch(&counter->waiting, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&counter->lock);
+}
+
+int emq_dispatch_in_callback(void)
+{
+	pthread_once(&emq_dispatch_once, emq_dispatch_key_create);
+
+	return pthread_getspecific(emq_dispatch_current) != NULL;
+}
+
+static int emq_dispatch_push(emq_dispatch_worker *worker, emq_dispatch_job *job)
+{
+	emq_dispatch_cell *cell;
+	size_t pos, seq;
+
+	pos = EMQ_ATOMIC_LOAD(&worker->head);
+
+	for (;;)
+	{
+		cell = &worker->cells[pos & worker->mask];
+		seq = EMQ_ATOMIC_LOAD(&cell->sequence);
+
+		if (seq == pos) {
+			if (__sync_bool_compare_and_swap(&worker->head, pos, pos + 1)) {
+				break;
+			}
+		} else if ((long)(seq - pos) < 0) {
+			return EMQ_STATUS_ERR;
+		}
+
+		pos = EMQ_ATOMIC_LOAD(&worker->head);
+	}
+
+	memcpy(&cell->job, job, sizeof(*job));
+	EMQ_ATOMIC_STORE(&cell->sequence, pos + 1);
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_dispatch_pop(emq_dispatch_worker *worker, emq_dispatch_job *job)
+{
+	emq_dispatch_cell *cell = &worker->cells[worker->tail & worker->mask];
+
+	if (EMQ_ATOMIC_LOAD(&cell->sequence) != worker->tail + 1) {
+		return EMQ_STATUS_ERR;
+	}
+
+	memcpy(job, &cell->job, sizeof(*job));
+	EMQ_ATOMIC_STORE(&cell->sequence, worker->tail + worker->mask + 1);
+	worker->tail++;
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_dispatch_empty(emq_dispatch_worker *worker)
+{
+	return EMQ_ATOMIC_LOAD(&worker->cells[worker->tail & worker->mask].sequence) != worker->tail + 1;
+}
+
+static void emq_dispatch_wake(emq_dispatch_worker *worker)
+{
+	if (EMQ_ATOMIC_LOAD(&worker->sleeping)) {
+		pthread_mutex_lock(&worker->lock);
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+static void *emq_dispatch_worker_main(void *data)
+{
+	emq_dispatch_worker *worker = data;
+	emq_dispatcher *dispatcher = worker->dispatcher;
+	emq_dispatch_job job;
+	int spin = 0;
+
+	pthread_setspecific(emq_dispatch_current, worker);
+
+	for (;;)
+	{
+		if (emq_dispatch_pop(worker, &job) == EMQ_STATUS_OK)
+		{
+			job.callback(job.owner->client, job.type, job.name,
+				(job.flags & EMQ_DISPATCH_JOB_TOPIC) ? job.topic : NULL,
+				(job.flags & EMQ_DISPATCH_JOB_PATTERN) ? job.pattern : NULL, job.msg);
+
+			emq_dispatch_counter_done(&job.owner->counter);
+			emq_dispatch_counter_done(&dispatcher->counter);
+			spin = 0;
+			continue;
+		}
+
+		if (EMQ_ATOMIC_LOAD(&dispatcher->stop)) {
+			break;
+		}
+
+		if (spin++ < EMQ_DISPATCH_SPIN) {
+			sched_yield();
+			continue;
+		}
+
+		pthread_mutex_lock(&worker->lock);
+		EMQ_ATOMIC_STORE(&worker->sleeping, 1);
+
+		while (emq_dispatch_empty(worker) && !EMQ_ATOMIC_LOAD(&dispatcher->stop)) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+
+		EMQ_ATOMIC_STORE(&worker->sleeping, 0);
+		pthread_mutex_unlock(&worker->lock);
+		spin = 0;
+	}
+
+	return NULL;
+}
+
+static size_t emq_dispatch_ring_size(size_t size)
+{
+	size_t ring_size = 2;
+
+	while (ring_size < size) {
+		ring_size *= 2;
+	}
+
+	return ring_size;
+}
+
+emq_dispatcher *emq_dispatcher_create(int workers, size_t ring_size)
+{
+	emq_dispatcher *dispatcher;
+	emq_dispatch_worker *worker;
+	size_t i;
+	int n;
+
+	if (workers <= 0) {
+		return NULL;
+	}
+
+	ring_size = emq_dispatch_ring_size(ring_size ? ring_size : EMQ_DEFAULT_DISPATCH_RING_SIZE);
+
+	dispatcher = (emq_dispatcher*)calloc(1, sizeof(*dispatcher));
+	if (!dispatcher) {
+		return NULL;
+	}
+
+	dispatcher->workers = (emq_dispatch_worker*)calloc(workers, sizeof(emq_dispatch_worker));
+	if (!dispatcher->workers) {
+		free(dispatcher);
+		return NULL;
+	}
+
+	pthread_once(&emq_dispatch_once, emq_dispatch_key_create);
+	emq_dispatch_counter_init(&dispatcher->counter);
+
+	for (n = 0; n < workers; n++)
+	{
+		worker = &dispatcher->workers[n];
+
+		worker->cells = (emq_dispatch_cell*)malloc(sizeof(emq_dispatch_cell) * ring_size);
+		if (!worker->cells) {
+			goto error;
+		}
+
+		for (i = 0; i < ring_size; i++) {
+			worker->cells[i].sequence = i;
+		}
+
+		worker->mask = ring_size - 1;
+		worker->dispatcher = dispatcher;
+
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->cond, NULL);
+
+		if (pthread_create(&worker->thread, NULL, emq_dispatch_worker_main, worker) != 0) {
+			pthread_mutex_destroy(&worker->lock);
+			pthread_cond_destroy(&worker->cond);
+			free(worker->cells);
+			goto error;
+		}
+
+		dispatcher->count++;
+	}
+
+	return dispatcher;
+
+error:
+	emq_dispatcher_release(dispatcher);
+	return NULL;
+}
+
+void emq_dispatcher_release(emq_dispatcher *dispatcher)
+{
+	emq_dispatch_worker *worker;
+	int n;
+
+	EMQ_ATOMIC_STORE(&dispatcher->stop, 1);
+
+	for (n = 0; n < dispatcher->count; n++)
+	{
+		worker = &dispatcher->workers[n];
+
+		pthread_mutex_lock(&worker->lock);
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+
+		pthread_join(worker->thread, NULL);
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->cond);
+		free(worker->cells);
+	}
+
+	emq_dispatch_counter_destroy(&dispatcher->counter);
+
+	free(dispatcher->workers);
+	free(dispatcher);
+}
+
+int emq_dispatcher_attach(emq_client *client, emq_dispatcher *dispatcher)
+{
+	emq_dispatch_client *owner;
+
+	EMQ_CLEAR_ERROR(client);
+
+	/* the message pool is not thread-safe */
+	if (client->msg_pool || client->dispatch) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	owner = (emq_dispatch_client*)calloc(1, sizeof(*owner));
+	if (!owner) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	owner->dispatcher = dispatcher;
+	owner->client = client;
+
+	emq_dispatch_counter_init(&owner->counter);
+	pthread_mutex_init(&owner->lock, NULL);
+
+	client->dispatch = owner;
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+/* Waits for the callbacks of the client and forgets the confirmations which were not sent */
+void emq_dispatch_unlink(emq_client *client)
+{
+	emq_dispatch_client *owner = client->dispatch;
+
+	emq_dispatch_counter_wait(&owner->counter);
+	emq_dispatch_counter_destroy(&owner->counter);
+	pthread_mutex_destroy(&owner->lock);
+
+	client->dispatch = NULL;
+
+	free(owner->confirms);
+	free(owner);
+}
+
+int emq_dispatcher_detach(emq_client *client)
+{
+	int status;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (!client->dispatch || emq_dispatch_in_callback()) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	emq_dispatch_counter_wait(&client->dispatch->counter);
+
+	status = emq_dispatch_flush(client);
+	emq_dispatch_unlink(client);
+
+	if (status == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+void emq_dispatcher_wait(emq_dispatcher *dispatcher)
+{
+	/* a callback waiting for the callbacks queued behind it would never return */
+	if (emq_dispatch_in_callback()) {
+		return;
+	}
+
+	emq_dispatch_counter_wait(&dispatcher->counter);
+}
+
+int emq_dispatcher_confirm(emq_client *client, const char *name, emq_tag tag)
+{
+	emq_dispatch_client *owner = client->dispatch;
+	protocol_request_queue_confirm *request;
+	size_t capacity;
+	void *ptr;
+
+	if (!owner || strlenz(name) > sizeof(request->body.name)) {
+		return EMQ_ERROR_DATA;
+	}
+
+	pthread_mutex_lock(&owner->lock);
+
+	if (owner->confirm_count == owner->confirm_capacity)
+	{
+		capacity = owner->confirm_capacity ? owner->confirm_capacity * 2 : EMQ_DEFAULT_CONFIRM_COUNT;
+
+		ptr = realloc(owner->confirms, sizeof(protocol_request_queue_confirm) * capacity);
+		if (!ptr) {
+			pthread_mutex_unlock(&owner->lock);
+			return EMQ_ERROR_ALLOC;
+		}
+
+		owner->confirms = (protocol_request_queue_confirm*)ptr;
+		owner->confirm_capacity = capacity;
+	}
+
+	request = &owner->confirms[owner->confirm_count];
+	memset(request, 0, sizeof(*request));
+
+	/* nobody reads a response in between the events, so the confirmations are noacked */
+	request->header.magic = EMQ_PROTOCOL_REQ;
+	request->header.cmd = EMQ_PROTOCOL_CMD_QUEUE_CONFIRM;
+	request->header.noack = 1;
+	request->header.bodylen = sizeof(request->body);
+	memcpy(request->body.name, name, strlenz(name));
+	request->body.tag = tag;
+
+	EMQ_ATOMIC_STORE(&owner->confirm_count, owner->confirm_count + 1);
+
+	pthread_mutex_unlock(&owner->lock);
+
+	return EMQ_ERROR_NONE;
+}
+
+/* Forgets the queued confirmations, their tags belong to a connection which is gone */
+void emq_dispatch_drop(emq_client *client)
+{
+	emq_dispatch_client *owner = client->dispatch;
+
+	pthread_mutex_lock(&owner->lock);
+	EMQ_ATOMIC_STORE(&owner->confirm_count, 0);
+	pthread_mutex_unlock(&owner->lock);
+}
+
+/* Writes the confirmations queued by the callbacks, called by the thread reading the events */
+int emq_dispatch_flush(emq_client *client)
+{
+	emq_dispatch_client *owner = client->dispatch;
+	protocol_request_queue_confirm *confirms;
+	size_t count;
+	int status;
+
+	if (!EMQ_ATOMIC_LOAD(&owner->confirm_count)) {
+		return EMQ_STATUS_OK;
+	}
+
+	pthread_mutex_lock(&owner->lock);
+
+	confirms = owner->confirms;
+	count = owner->confirm_count;
+
+	owner->confirms = NULL;
+	owner->confirm_capacity = 0;
+	EMQ_ATOMIC_STORE(&owner->confirm_count, 0);
+
+	pthread_mutex_unlock(&owner->lock);
+
+	status = emq_client_write(client, (char*)confirms, (int)(sizeof(*confirms) * count)) == -1 ?
+		EMQ_STATUS_ERR : EMQ_STATUS_OK;
+
+	free(confirms);
+
+	return status;
+}
+
+void emq_dispatcher_submit(emq_client *client, emq_msg_callback *callback,
+	int type, const char *name, const char *topic, const char *pattern, emq_msg *msg)
+{
+	emq_dispatcher *dispatcher = client->dispatch->dispatcher;
+	emq_dispatch_worker *worker;
+	emq_dispatch_job job;
+	unsigned int hash;
+
+	job.owner = client->dispatch;
+	job.callback = callback;
+	job.type = type;
+	job.flags = 0;
+	job.msg = msg;
+
+	emq_string_copy(job.name, name, sizeof(job.name));
+	hash = emq_dict_hash(job.name);
+
+	if (topic) {
+		emq_string_copy(job.topic, topic, sizeof(job.topic));
+		job.flags |= EMQ_DISPATCH_JOB_TOPIC;
+		hash = hash * 31 + emq_dict_hash(job.topic);
+	}
+
+	if (pattern) {
+		emq_string_copy(job.pattern, pattern, sizeof(job.pattern));
+		job.flags |= EMQ_DISPATCH_JOB_PATTERN;
+	}
+
+	worker = &dispatcher->workers[hash % dispatcher->count];
+
+	__atomic_add_fetch(&job.owner->counter.submitted, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&dispatcher->counter.submitted, 1, __ATOMIC_SEQ_CST);
+
+	/* a full ring stalls the reader, which leaves the rest to TCP flow control */
+	while (emq_dispatch_push(worker, &job) == EMQ_STATUS_ERR) {
+		emq_dispatch_wake(worker);
+		sched_yield();
+	}
+
+	emq_dispatch_wake(worker);
+}
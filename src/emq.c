@@ -28,12 +28,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/uio.h>
 
 #include "emq.h"
 #include "network.h"
 #include "protocol.h"
 #include "packet.h"
+#include "internal.h"
+#include "dispatch.h"
 
 #define strlenz(str) (strlen(str) + 1)
 
@@ -53,24 +56,79 @@ static const char *emq_error_array[] = {
 	"Memory error",
 	"Value not declared",
 	"Value not found",
-	"No data"
+	"No data",
+	"Message truncated"
 };
 
-typedef struct emq_queue_subscription {
-	char name[64];
-	emq_msg_callback *callback;
-} emq_queue_subscription;
+typedef struct emq_pipeline_command {
+	uint8_t cmd;
+	uint8_t noack;
+	size_t offset;
+	size_t length;
+	emq_msg *msg;
+} emq_pipeline_command;
 
-typedef struct emq_channel_subscription {
+typedef struct emq_pipeline {
+	int active;
+	char *buffer;
+	size_t size;
+	size_t pos;
+	emq_pipeline_command *commands;
+	size_t count;
+	size_t capacity;
+	struct iovec *iov;
+	size_t iov_capacity;
+} emq_pipeline;
+
+typedef struct emq_prefetch {
 	char name[64];
-	char channel[32];
-	emq_msg_callback *callback;
-} emq_channel_subscription;
-
-static emq_list *emq_list_init(void);
-static int emq_list_add_value(emq_list *list, void *value);
-static void emq_queue_subscription_list_free_handler(void *value);
-static void emq_channel_subscription_list_free_handler(void *value);
+	emq_time timeout;
+	size_t window;
+	size_t pending;
+	int no_data;
+	emq_msg **msgs;
+	size_t head;
+	size_t count;
+	size_t capacity;
+} emq_prefetch;
+
+typedef struct emq_confirm {
+	protocol_request_queue_confirm *requests;
+	size_t count;
+	size_t capacity;
+	size_t max_count;
+	uint32_t max_delay;
+	long long first;
+	emq_confirm_callback *callback;
+} emq_confirm;
+
+typedef struct emq_window {
+	size_t count;
+	uint32_t interval;
+	size_t pending;
+	long long last;
+	emq_noack_stats stats;
+} emq_window;
+
+typedef struct emq_endpoint {
+	char addr[256];
+	int port;
+	int local;
+	int auth;
+	char name[32];
+	char password[32];
+	char (*declared)[64];
+	size_t declared_count;
+	size_t declared_capacity;
+	int retries;
+	emq_backoff backoff;
+} emq_endpoint;
+
+static void emq_queue_subscription_dict_free_handler(void *value);
+static void emq_channel_table_dict_free_handler(void *value);
+static void emq_noack_sent(emq_client *client, size_t count);
+static int emq_session_replay(emq_client *client);
+static int emq_queue_prefetch_drain(emq_client *client);
 
 static emq_client *emq_client_init(void)
 {
@@ -90,44 +148,110 @@ static emq_client *emq_client_init(void)
 	client->request = (char*)malloc(EMQ_DEFAULT_REQUEST_SIZE);
 	client->size = EMQ_DEFAULT_REQUEST_SIZE;
 	client->pos = 0;
+	client->input = (char*)malloc(EMQ_DEFAULT_INPUT_SIZE);
+	client->input_size = EMQ_DEFAULT_INPUT_SIZE;
+	client->input_pos = 0;
+	client->input_len = 0;
 	client->noack = 0;
 	client->fd = 0;
-	client->queue_subscriptions = emq_list_init();
-	client->channel_subscriptions = emq_list_init();
-
-	if (!client->request) {
+	client->queue_subscriptions = emq_dict_init();
+	client->channel_subscriptions = emq_dict_init();
+	client->pipeline = NULL;
+	client->prefetch = NULL;
+	client->confirm = NULL;
+	client->msg_pool = NULL;
+	client->dispatch = NULL;
+	client->inboxes = NULL;
+	client->batches = NULL;
+	client->drains = NULL;
+	client->window = NULL;
+	client->endpoint = NULL;
+
+	if (!client->request || !client->input) {
+		free(client->request);
+		free(client->input);
 		free(client);
 		return NULL;
 	}
 
-	if (!client->queue_subscriptions) {
-		free(client->request);
-		free(client);
-	}
+	if (!client->queue_subscriptions || !client->channel_subscriptions) {
+		if (client->queue_subscriptions) {
+			emq_dict_release(client->queue_subscriptions);
+		}
+
+		if (client->channel_subscriptions) {
+			emq_dict_release(client->channel_subscriptions);
+		}
 
-	if (!client->channel_subscriptions) {
-		emq_list_release(client->queue_subscriptions);
 		free(client->request);
+		free(client->input);
 		free(client);
+		return NULL;
 	}
 
-	EMQ_LIST_SET_FREE_METHOD(client->queue_subscriptions, emq_queue_subscription_list_free_handler);
-	EMQ_LIST_SET_FREE_METHOD(client->channel_subscriptions, emq_channel_subscription_list_free_handler);
+	EMQ_DICT_SET_FREE_METHOD(client->queue_subscriptions, emq_queue_subscription_dict_free_handler);
+	EMQ_DICT_SET_FREE_METHOD(client->channel_subscriptions, emq_channel_table_dict_free_handler);
 
 	return client;
 }
 
+static void emq_pipeline_release(emq_pipeline *pipeline);
+static void emq_prefetch_release(emq_prefetch *prefetch);
+static void emq_confirm_release(emq_confirm *confirm);
+static void emq_queue_confirm_drop(emq_client *client, size_t count, int error);
+
 static void emq_client_release(emq_client *client)
 {
-	emq_list_release(client->queue_subscriptions);
-	emq_list_release(client->channel_subscriptions);
+	free(client->window);
+
+	if (client->endpoint) {
+		free(client->endpoint->declared);
+		free(client->endpoint);
+	}
+
+	if (client->pipeline) {
+		emq_pipeline_release(client->pipeline);
+	}
+
+	if (client->prefetch) {
+		emq_prefetch_release(client->prefetch);
+	}
+
+	if (client->confirm) {
+		emq_confirm_release(client->confirm);
+	}
+
+	emq_dict_release(client->queue_subscriptions);
+	emq_dict_release(client->channel_subscriptions);
+
+	if (client->inboxes) {
+		emq_inboxes_release(client->inboxes);
+	}
+
+	emq_msg_pool_detach(client);
+
 	free(client->request);
+	free(client->input);
 	free(client);
 }
 
-static void emq_client_set_error(emq_client *client, int error)
+void emq_client_set_error(emq_client *client, int error)
 {
 	snprintf(client->error, sizeof(client->error), "%s", emq_error_array[error]);
+	client->error_code = error;
+}
+
+/* Copies at most size - 1 characters and always terminates dst */
+void emq_string_copy(char *dst, const char *src, size_t size)
+{
+	size_t length = 0;
+
+	while (length < size - 1 && src[length]) {
+		length++;
+	}
+
+	memcpy(dst, src, length);
+	dst[length] = '\0';
 }
 
 static emq_list *emq_list_init(void)
@@ -232,6 +356,189 @@ emq_list_node *emq_list_next(emq_list_iterator *iter)
 	return current;
 }
 
+unsigned int emq_dict_hash(const char *key)
+{
+	unsigned int hash = 2166136261U;
+
+	while (*key) {
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+emq_dict *emq_dict_init(void)
+{
+	emq_dict *dict;
+
+	dict = (emq_dict*)malloc(sizeof(*dict));
+	if (!dict) {
+		return NULL;
+	}
+
+	dict->table = (emq_dict_entry**)calloc(EMQ_DICT_INITIAL_SIZE, sizeof(emq_dict_entry*));
+	if (!dict->table) {
+		free(dict);
+		return NULL;
+	}
+
+	dict->size = EMQ_DICT_INITIAL_SIZE;
+	dict->mask = EMQ_DICT_INITIAL_SIZE - 1;
+	dict->count = 0;
+	dict->free = NULL;
+
+	return dict;
+}
+
+static int emq_dict_expand(emq_dict *dict)
+{
+	emq_dict_entry **table, *entry, *next;
+	size_t size, i;
+
+	size = dict->size * 2;
+
+	table = (emq_dict_entry**)calloc(size, sizeof(emq_dict_entry*));
+	if (!table) {
+		return EMQ_STATUS_ERR;
+	}
+
+	for (i = 0; i < dict->size; i++)
+	{
+		entry = dict->table[i];
+
+		while (entry) {
+			next = entry->next;
+			entry->next = table[entry->hash & (size - 1)];
+			table[entry->hash & (size - 1)] = entry;
+			entry = next;
+		}
+	}
+
+	free(dict->table);
+
+	dict->table = table;
+	dict->size = size;
+	dict->mask = size - 1;
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_dict_add(emq_dict *dict, const char *key, void *value)
+{
+	emq_dict_entry *entry;
+	size_t index;
+
+	if (dict->count >= dict->size && emq_dict_expand(dict) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
+
+	entry = (emq_dict_entry*)malloc(sizeof(*entry));
+	if (!entry) {
+		return EMQ_STATUS_ERR;
+	}
+
+	entry->hash = emq_dict_hash(key);
+	entry->key = key;
+	entry->value = value;
+
+	index = entry->hash & dict->mask;
+
+	entry->next = dict->table[index];
+	dict->table[index] = entry;
+
+	dict->count++;
+
+	return EMQ_STATUS_OK;
+}
+
+emq_dict_entry *emq_dict_find(emq_dict *dict, const char *key, unsigned int hash)
+{
+	emq_dict_entry *entry;
+
+	for (entry = dict->table[hash & dict->mask]; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && !strcmp(entry->key, key)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+int emq_dict_delete(emq_dict *dict, const char *key, unsigned int hash)
+{
+	emq_dict_entry **link, *entry;
+
+	for (link = &dict->table[hash & dict->mask]; (entry = *link) != NULL; link = &entry->next)
+	{
+		if (entry->hash == hash && !strcmp(entry->key, key))
+		{
+			*link = entry->next;
+
+			if (dict->free) {
+				dict->free(entry->value);
+			}
+
+			free(entry);
+			dict->count--;
+
+			return EMQ_STATUS_OK;
+		}
+	}
+
+	return EMQ_STATUS_ERR;
+}
+
+void emq_dict_release(emq_dict *dict)
+{
+	emq_dict_entry *entry, *next;
+	size_t i;
+
+	for (i = 0; i < dict->size; i++)
+	{
+		entry = dict->table[i];
+
+		while (entry) {
+			next = entry->next;
+
+			if (dict->free) {
+				dict->free(entry->value);
+			}
+
+			free(entry);
+			entry = next;
+		}
+	}
+
+	free(dict->table);
+	free(dict);
+}
+
+void emq_dict_rewind(emq_dict *dict, emq_dict_iterator *iter)
+{
+	iter->dict = dict;
+	iter->index = 0;
+	iter->next = NULL;
+}
+
+emq_dict_entry *emq_dict_next(emq_dict_iterator *iter)
+{
+	emq_dict_entry *current;
+
+	while (!iter->next && iter->index < iter->dict->size) {
+		iter->next = iter->dict->table[iter->index++];
+	}
+
+	current = iter->next;
+
+	if (current != NULL) {
+		iter->next = current->next;
+	}
+
+	return current;
+}
+
 static emq_user *emq_user_init(void)
 {
 	emq_user *user;
@@ -338,10 +645,23 @@ static emq_queue_subscription *emq_queue_subscription_create(const char *name, e
 
 static void emq_queue_subscription_release(emq_queue_subscription *subscription)
 {
+	if (subscription->inbox) {
+		emq_inbox_release(subscription->inbox);
+	}
+
+	if (subscription->batcher) {
+		emq_batcher_release(subscription->batcher);
+	}
+
+	if (subscription->drain) {
+		emq_drain_release(subscription->drain);
+	}
+
 	free(subscription);
 }
 
-static emq_channel_subscription *emq_channel_subscription_create(const char *name, const char *data, emq_msg_callback *callback)
+static emq_channel_subscription *emq_channel_subscription_create(const char *name, const char *data, int pattern,
+	emq_msg_callback *callback)
 {
 	emq_channel_subscription *subscription;
 
@@ -354,254 +674,2857 @@ static emq_channel_subscription *emq_channel_subscription_create(const char *nam
 
 	memcpy(subscription->name, name, strlenz(name));
 	memcpy(subscription->channel, data, strlenz(data));
+	subscription->pattern = pattern;
 	subscription->callback = callback;
 
+	if (pattern && emq_pattern_compile(&subscription->matcher, subscription->channel) == EMQ_STATUS_ERR) {
+		free(subscription);
+		return NULL;
+	}
+
 	return subscription;
 }
 
 static void emq_channel_subscription_release(emq_channel_subscription *subscription)
 {
+	if (subscription->inbox) {
+		emq_inbox_release(subscription->inbox);
+	}
+
+	if (subscription->batcher) {
+		emq_batcher_release(subscription->batcher);
+	}
+
+	emq_pattern_release(&subscription->matcher);
 	free(subscription);
 }
 
-static void emq_user_list_free_handler(void *value)
+static void emq_channel_subscription_dict_free_handler(void *value)
 {
-	emq_user_release(value);
+	emq_channel_subscription_release(value);
 }
 
-static void emq_queue_list_free_handler(void *value)
+static emq_channel_table *emq_channel_table_create(const char *name)
 {
-	emq_queue_release(value);
-}
+	emq_channel_table *table;
 
-static void emq_route_list_free_handler(void *value)
-{
-	emq_route_release(value);
-}
+	table = (emq_channel_table*)malloc(sizeof(*table));
+	if (!table) {
+		return NULL;
+	}
 
-static void emq_channel_list_free_handler(void *value)
-{
-	emq_channel_release(value);
-}
+	memset(table, 0, sizeof(*table));
 
-static void emq_route_key_list_free_handler(void *value)
-{
-	emq_route_key_release(value);
-}
+	memcpy(table->name, name, strlenz(name));
 
-static void emq_queue_subscription_list_free_handler(void *value)
-{
-	emq_queue_subscription_release(value);
-}
+	table->topics = emq_dict_init();
+	table->patterns = emq_dict_init();
 
-static void emq_channel_subscription_list_free_handler(void *value)
-{
-	emq_channel_subscription_release(value);
-}
+	if (!table->topics || !table->patterns) {
+		if (table->topics) {
+			emq_dict_release(table->topics);
+		}
 
-emq_msg *emq_msg_create(void *data, size_t size, int zero_copy)
-{
-	emq_msg *msg;
+		if (table->patterns) {
+			emq_dict_release(table->patterns);
+		}
 
-	msg = (emq_msg*)malloc(sizeof(*msg));
-	if (!msg) {
+		free(table);
 		return NULL;
 	}
 
-	msg->size = size;
-	msg->tag = 0;
-	msg->expire = 0;
-	msg->zero_copy = zero_copy;
+	EMQ_DICT_SET_FREE_METHOD(table->topics, emq_channel_subscription_dict_free_handler);
+	EMQ_DICT_SET_FREE_METHOD(table->patterns, emq_channel_subscription_dict_free_handler);
 
-	if (!zero_copy) {
-		msg->data = malloc(size);
-		if (!msg->data) {
-			free(msg);
-			return NULL;
-		}
-		memcpy(msg->data, data, size);
-	} else {
-		msg->data = data;
-	}
+	return table;
+}
 
-	return msg;
+static void emq_channel_table_release(emq_channel_table *table)
+{
+	emq_dict_release(table->topics);
+	emq_dict_release(table->patterns);
+	free(table);
 }
 
-emq_msg *emq_msg_copy(emq_msg *msg)
+static emq_pipeline *emq_pipeline_create(void)
 {
-	emq_msg *new_msg;
+	emq_pipeline *pipeline;
 
-	new_msg = (emq_msg*)malloc(sizeof(*new_msg));
-	if (!new_msg) {
+	pipeline = (emq_pipeline*)calloc(1, sizeof(*pipeline));
+	if (!pipeline) {
 		return NULL;
 	}
 
-	new_msg->data = malloc(msg->size);
-	new_msg->size = msg->size;
-	new_msg->tag = msg->tag;
-	new_msg->expire = msg->expire;
+	pipeline->buffer = (char*)malloc(EMQ_DEFAULT_REQUEST_SIZE);
+	pipeline->size = EMQ_DEFAULT_REQUEST_SIZE;
+	pipeline->commands = (emq_pipeline_command*)malloc(sizeof(emq_pipeline_command) * EMQ_DEFAULT_PIPELINE_SIZE);
+	pipeline->capacity = EMQ_DEFAULT_PIPELINE_SIZE;
 
-	if (!new_msg->data) {
-		free(new_msg);
+	if (!pipeline->buffer || !pipeline->commands) {
+		free(pipeline->buffer);
+		free(pipeline->commands);
+		free(pipeline);
 		return NULL;
 	}
 
-	memcpy(new_msg->data, msg->data, msg->size);
-
-	return new_msg;
+	return pipeline;
 }
 
-void emq_msg_expire(emq_msg *msg, emq_time time)
+static void emq_pipeline_truncate(emq_pipeline *pipeline, size_t count, size_t pos)
 {
-	msg->expire = time;
-}
+	size_t i;
 
-void *emq_msg_data(emq_msg *msg)
-{
-	return msg->data;
+	for (i = count; i < pipeline->count; i++)
+	{
+		if (pipeline->commands[i].msg) {
+			emq_msg_unref(pipeline->commands[i].msg);
+		}
+	}
+
+	pipeline->count = count;
+	pipeline->pos = pos;
 }
 
-size_t emq_msg_size(emq_msg *msg)
+static void emq_pipeline_reset(emq_pipeline *pipeline)
 {
-	return msg->size;
+	emq_pipeline_truncate(pipeline, 0, 0);
+	pipeline->active = 0;
 }
 
-emq_tag emq_msg_tag(emq_msg *msg)
+static void emq_pipeline_release(emq_pipeline *pipeline)
 {
-	return msg->tag;
+	emq_pipeline_truncate(pipeline, 0, 0);
+	free(pipeline->buffer);
+	free(pipeline->commands);
+	free(pipeline->iov);
+	free(pipeline);
 }
 
-void emq_msg_release(emq_msg *msg)
+static int emq_pipeline_append(emq_client *client, uint8_t cmd, void *extra, size_t extra_size,
+	emq_msg *msg)
 {
-	if (!msg->zero_copy) {
-		free(msg->data);
-	}
+	emq_pipeline *pipeline = client->pipeline;
+	emq_pipeline_command *command;
+	size_t length = client->pos + extra_size;
+	size_t new_size;
+	void *ptr;
+
+	if (pipeline->pos + length > pipeline->size) {
+		new_size = pipeline->size * 2;
+		while (new_size < pipeline->pos + length) {
+			new_size *= 2;
+		}
 
-	free(msg);
-}
+		ptr = realloc(pipeline->buffer, new_size);
+		if (!ptr) {
+			return EMQ_STATUS_ERR;
+		}
 
-emq_client *emq_tcp_connect(const char *addr, int port)
-{
-	emq_client *client = emq_client_init();
+		pipeline->buffer = (char*)ptr;
+		pipeline->size = new_size;
+	}
 
-	if (!client) {
-		return NULL;
+	if (pipeline->count == pipeline->capacity) {
+		ptr = realloc(pipeline->commands, sizeof(emq_pipeline_command) * pipeline->capacity * 2);
+		if (!ptr) {
+			return EMQ_STATUS_ERR;
+		}
+
+		pipeline->commands = (emq_pipeline_command*)ptr;
+		pipeline->capacity *= 2;
 	}
 
-	EMQ_CLEAR_ERROR(client);
+	command = &pipeline->commands[pipeline->count++];
 
-	if ((emq_client_tcp_connect(client, addr, port)) == EMQ_NET_ERR) {
-		emq_client_release(client);
-		return NULL;
+	command->cmd = cmd;
+	command->noack = client->noack;
+	command->offset = pipeline->pos;
+	command->length = length;
+	command->msg = msg ? emq_msg_ref(msg) : NULL;
+
+	memcpy(pipeline->buffer + pipeline->pos, client->request, client->pos);
+	pipeline->pos += client->pos;
+
+	if (extra_size) {
+		memcpy(pipeline->buffer + pipeline->pos, extra, extra_size);
+		pipeline->pos += extra_size;
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return client;
+	return EMQ_STATUS_OK;
 }
 
-emq_client *emq_unix_connect(const char *path)
+static int emq_pipeline_check_iov(emq_pipeline *pipeline, size_t count)
 {
-	emq_client *client = emq_client_init();
-
-	if (!client) {
-		return NULL;
-	}
+	struct iovec *iov;
 
-	EMQ_CLEAR_ERROR(client);
+	if (pipeline->iov_capacity < count) {
+		iov = (struct iovec*)realloc(pipeline->iov, sizeof(struct iovec) * count);
+		if (!iov) {
+			return EMQ_STATUS_ERR;
+		}
 
-	if ((emq_client_unix_connect(client, path)) == EMQ_NET_ERR) {
-		emq_client_release(client);
-		return NULL;
+		pipeline->iov = iov;
+		pipeline->iov_capacity = count;
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return client;
+	return EMQ_STATUS_OK;
 }
 
-void emq_disconnect(emq_client *client)
+static void emq_pipeline_set_statuses(int *statuses, size_t from, size_t to, int error)
+{
+	size_t i;
+
+	if (!statuses) {
+		return;
+	}
+
+	for (i = from; i < to; i++) {
+		statuses[i] = error;
+	}
+}
+
+static emq_prefetch *emq_prefetch_create(void)
+{
+	return (emq_prefetch*)calloc(1, sizeof(emq_prefetch));
+}
+
+static void emq_prefetch_release(emq_prefetch *prefetch)
+{
+	size_t i;
+
+	for (i = prefetch->head; i < prefetch->count; i++) {
+		emq_msg_release(prefetch->msgs[i]);
+	}
+
+	free(prefetch->msgs);
+	free(prefetch);
+}
+
+static int emq_prefetch_push(emq_prefetch *prefetch, emq_msg *msg)
+{
+	size_t capacity;
+	void *ptr;
+
+	if (prefetch->count == prefetch->capacity)
+	{
+		if (prefetch->head) {
+			memmove(prefetch->msgs, prefetch->msgs + prefetch->head,
+				sizeof(emq_msg*) * (prefetch->count - prefetch->head));
+			prefetch->count -= prefetch->head;
+			prefetch->head = 0;
+		} else {
+			capacity = prefetch->capacity ? prefetch->capacity * 2 : EMQ_DEFAULT_PIPELINE_SIZE;
+
+			ptr = realloc(prefetch->msgs, sizeof(emq_msg*) * capacity);
+			if (!ptr) {
+				return EMQ_STATUS_ERR;
+			}
+
+			prefetch->msgs = (emq_msg**)ptr;
+			prefetch->capacity = capacity;
+		}
+	}
+
+	prefetch->msgs[prefetch->count++] = msg;
+
+	return EMQ_STATUS_OK;
+}
+
+static emq_msg *emq_prefetch_take(emq_prefetch *prefetch)
+{
+	emq_msg *msg;
+
+	if (prefetch->head == prefetch->count) {
+		return NULL;
+	}
+
+	msg = prefetch->msgs[prefetch->head++];
+
+	if (prefetch->head == prefetch->count) {
+		prefetch->head = 0;
+		prefetch->count = 0;
+	}
+
+	return msg;
+}
+
+/* Puts back the message returned by the last emq_prefetch_take */
+static void emq_prefetch_untake(emq_prefetch *prefetch, emq_msg *msg)
+{
+	if (prefetch->head) {
+		prefetch->msgs[--prefetch->head] = msg;
+	} else {
+		prefetch->msgs[prefetch->count++] = msg;
+	}
+}
+
+static emq_confirm *emq_confirm_create(void)
+{
+	emq_confirm *confirm;
+
+	confirm = (emq_confirm*)calloc(1, sizeof(*confirm));
+	if (!confirm) {
+		return NULL;
+	}
+
+	confirm->max_count = EMQ_DEFAULT_CONFIRM_COUNT;
+	confirm->max_delay = EMQ_DEFAULT_CONFIRM_DELAY;
+
+	return confirm;
+}
+
+static void emq_confirm_release(emq_confirm *confirm)
+{
+	free(confirm->requests);
+	free(confirm);
+}
+
+static int emq_queue_confirm_expire(emq_client *client)
+{
+	emq_confirm *confirm = client->confirm;
+
+	if (confirm && confirm->count && emq_mstime() - confirm->first >= confirm->max_delay) {
+		return emq_queue_confirm_flush(client);
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+#define EMQ_PREFETCH_LENGTH(prefetch) ((prefetch)->count - (prefetch)->head)
+#define EMQ_PREFETCH_MATCH(client, queue, time) ((client)->prefetch && \
+	(client)->prefetch->timeout == (time) && !strcmp((client)->prefetch->name, (queue)))
+
+#define EMQ_PREFETCH_DRAIN(client) ((client)->prefetch && emq_queue_prefetch_drain(client) == EMQ_STATUS_ERR)
+
+#define EMQ_PIPELINE_ACTIVE(client) ((client)->pipeline && (client)->pipeline->active)
+
+int emq_pipeline_active(emq_client *client)
+{
+	return EMQ_PIPELINE_ACTIVE(client);
+}
+
+static void emq_user_list_free_handler(void *value)
+{
+	emq_user_release(value);
+}
+
+static void emq_queue_list_free_handler(void *value)
+{
+	emq_queue_release(value);
+}
+
+static void emq_route_list_free_handler(void *value)
+{
+	emq_route_release(value);
+}
+
+static void emq_channel_list_free_handler(void *value)
+{
+	emq_channel_release(value);
+}
+
+static void emq_route_key_list_free_handler(void *value)
+{
+	emq_route_key_release(value);
+}
+
+static void emq_queue_subscription_dict_free_handler(void *value)
+{
+	emq_queue_subscription_release(value);
+}
+
+static void emq_channel_table_dict_free_handler(void *value)
+{
+	emq_channel_table_release(value);
+}
+
+int emq_queue_subscription_add(emq_client *client, const char *name, uint32_t flags, emq_msg_callback *callback)
+{
+	emq_queue_subscription *subscription;
+
+	if ((subscription = emq_queue_subscription_find(client, name)) != NULL) {
+		subscription->flags = flags;
+		subscription->callback = callback;
+		return EMQ_STATUS_OK;
+	}
+
+	subscription = emq_queue_subscription_create(name, callback);
+	if (!subscription) {
+		return EMQ_STATUS_ERR;
+	}
+
+	subscription->flags = flags;
+
+	if (emq_dict_add(client->queue_subscriptions, subscription->name, subscription) == EMQ_STATUS_ERR) {
+		emq_queue_subscription_release(subscription);
+		return EMQ_STATUS_ERR;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+emq_queue_subscription *emq_queue_subscription_find(emq_client *client, const char *name)
+{
+	emq_dict_entry *entry;
+
+	if (!EMQ_DICT_LENGTH(client->queue_subscriptions)) {
+		return NULL;
+	}
+
+	entry = emq_dict_find(client->queue_subscriptions, name, emq_dict_hash(name));
+
+	return entry ? entry->value : NULL;
+}
+
+void emq_queue_subscription_delete(emq_client *client, const char *name)
+{
+	emq_dict_delete(client->queue_subscriptions, name, emq_dict_hash(name));
+}
+
+static int emq_pattern_class(emq_pattern_op *op, const char *text, size_t *pos)
+{
+	size_t i = *pos;
+	int negate = 0, c, end;
+
+	if (text[i] == '^' || text[i] == '!') {
+		negate = 1;
+		i++;
+	}
+
+	while (text[i] && text[i] != ']')
+	{
+		if (text[i] == '\\' && text[i + 1]) {
+			i++;
+		}
+
+		c = (unsigned char)text[i++];
+		end = c;
+
+		if (text[i] == '-' && text[i + 1] && text[i + 1] != ']') {
+			i++;
+
+			if (text[i] == '\\' && text[i + 1]) {
+				i++;
+			}
+
+			end = (unsigned char)text[i++];
+
+			if (end < c) {
+				int tmp = c;
+				c = end;
+				end = tmp;
+			}
+		}
+
+		for (; c <= end; c++) {
+			op->set[c >> 3] |= (uint8_t)(1 << (c & 7));
+		}
+	}
+
+	if (text[i] != ']') {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (negate) {
+		for (c = 0; c < 32; c++) {
+			op->set[c] = (uint8_t)~op->set[c];
+		}
+	}
+
+	op->type = EMQ_PATTERN_OP_CLASS;
+	*pos = i + 1;
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_pattern_compile(emq_pattern *pattern, const char *text)
+{
+	size_t length, mark, i;
+	emq_pattern_op *op;
+
+	memset(pattern, 0, sizeof(*pattern));
+
+	length = strcspn(text, "*?[\\");
+
+	if (!text[length]) {
+		pattern->type = EMQ_PATTERN_EXACT;
+		pattern->length = length;
+		return EMQ_STATUS_OK;
+	}
+
+	if (text[length] == '*' && !text[length + strspn(text + length, "*")]) {
+		pattern->type = EMQ_PATTERN_PREFIX;
+		pattern->length = length;
+		return EMQ_STATUS_OK;
+	}
+
+	pattern->type = EMQ_PATTERN_GLOB;
+	pattern->ops = (emq_pattern_op*)calloc(strlen(text), sizeof(emq_pattern_op));
+
+	if (!pattern->ops) {
+		return EMQ_STATUS_ERR;
+	}
+
+	i = 0;
+
+	while (text[i])
+	{
+		op = &pattern->ops[pattern->count];
+
+		switch (text[i])
+		{
+			case '*':
+				while (text[i] == '*') {
+					i++;
+				}
+				op->type = EMQ_PATTERN_OP_STAR;
+				break;
+			case '?':
+				op->type = EMQ_PATTERN_OP_ANY;
+				i++;
+				break;
+			case '[':
+				mark = ++i;
+				if (emq_pattern_class(op, text, &i) == EMQ_STATUS_OK) {
+					break;
+				}
+				memset(op, 0, sizeof(*op));
+				op->type = EMQ_PATTERN_OP_CHAR;
+				op->c = '[';
+				i = mark;
+				break;
+			case '\\':
+				if (text[i + 1]) {
+					i++;
+				}
+				/* fall through */
+			default:
+				op->type = EMQ_PATTERN_OP_CHAR;
+				op->c = (uint8_t)text[i++];
+				break;
+		}
+
+		pattern->count++;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_pattern_match_op(const emq_pattern_op *op, uint8_t c)
+{
+	switch (op->type)
+	{
+		case EMQ_PATTERN_OP_CHAR:
+			return op->c == c;
+		case EMQ_PATTERN_OP_ANY:
+			return 1;
+		case EMQ_PATTERN_OP_CLASS:
+			return (op->set[c >> 3] >> (c & 7)) & 1;
+	}
+
+	return 0;
+}
+
+int emq_pattern_match(const emq_pattern *pattern, const char *text, const char *str)
+{
+	const char *mark = NULL;
+	size_t i = 0, star = 0;
+
+	switch (pattern->type)
+	{
+		case EMQ_PATTERN_EXACT:
+			return !strcmp(text, str);
+		case EMQ_PATTERN_PREFIX:
+			return !strncmp(text, str, pattern->length);
+	}
+
+	while (*str)
+	{
+		if (i < pattern->count && pattern->ops[i].type == EMQ_PATTERN_OP_STAR) {
+			star = ++i;
+			mark = str;
+			continue;
+		}
+
+		if (i < pattern->count && emq_pattern_match_op(&pattern->ops[i], (uint8_t)*str)) {
+			i++;
+			str++;
+			continue;
+		}
+
+		if (!mark) {
+			return 0;
+		}
+
+		i = star;
+		str = ++mark;
+	}
+
+	while (i < pattern->count && pattern->ops[i].type == EMQ_PATTERN_OP_STAR) {
+		i++;
+	}
+
+	return i == pattern->count;
+}
+
+void emq_pattern_release(emq_pattern *pattern)
+{
+	free(pattern->ops);
+	pattern->ops = NULL;
+}
+
+int emq_channel_subscription_add(emq_client *client, const char *name, const char *channel, int pattern,
+	emq_msg_callback *callback)
+{
+	emq_channel_subscription *subscription;
+	emq_channel_table *table;
+	emq_dict_entry *entry;
+	emq_dict *dict;
+
+	entry = emq_dict_find(client->channel_subscriptions, name, emq_dict_hash(name));
+
+	if (entry) {
+		table = entry->value;
+	} else {
+		table = emq_channel_table_create(name);
+		if (!table) {
+			return EMQ_STATUS_ERR;
+		}
+
+		if (emq_dict_add(client->channel_subscriptions, table->name, table) == EMQ_STATUS_ERR) {
+			emq_channel_table_release(table);
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	dict = pattern ? table->patterns : table->topics;
+
+	if ((entry = emq_dict_find(dict, channel, emq_dict_hash(channel))) != NULL) {
+		subscription = entry->value;
+		subscription->callback = callback;
+		return EMQ_STATUS_OK;
+	}
+
+	subscription = emq_channel_subscription_create(name, channel, pattern, callback);
+	if (!subscription) {
+		goto error;
+	}
+
+	if (emq_dict_add(dict, subscription->channel, subscription) == EMQ_STATUS_ERR) {
+		emq_channel_subscription_release(subscription);
+		goto error;
+	}
+
+	return EMQ_STATUS_OK;
+
+error:
+	if (!EMQ_DICT_LENGTH(table->topics) && !EMQ_DICT_LENGTH(table->patterns)) {
+		emq_dict_delete(client->channel_subscriptions, name, emq_dict_hash(name));
+	}
+
+	return EMQ_STATUS_ERR;
+}
+
+emq_channel_subscription *emq_channel_subscription_find(emq_client *client, const char *name,
+	const char *topic, const char *pattern)
+{
+	emq_channel_subscription *subscription;
+	emq_channel_table *table;
+	emq_dict_iterator iter;
+	emq_dict_entry *entry;
+
+	if (!EMQ_DICT_LENGTH(client->channel_subscriptions)) {
+		return NULL;
+	}
+
+	entry = emq_dict_find(client->channel_subscriptions, name, emq_dict_hash(name));
+	if (!entry) {
+		return NULL;
+	}
+
+	table = entry->value;
+
+	if (!pattern) {
+		entry = emq_dict_find(table->topics, topic, emq_dict_hash(topic));
+		return entry ? entry->value : NULL;
+	}
+
+	if ((entry = emq_dict_find(table->patterns, pattern, emq_dict_hash(pattern))) != NULL) {
+		return entry->value;
+	}
+
+	emq_dict_rewind(table->patterns, &iter);
+	while ((entry = emq_dict_next(&iter)) != NULL)
+	{
+		subscription = entry->value;
+		if (emq_pattern_match(&subscription->matcher, subscription->channel, topic)) {
+			return subscription;
+		}
+	}
+
+	return NULL;
+}
+
+emq_channel_subscription *emq_channel_subscription_get(emq_client *client, const char *name, const char *channel)
+{
+	emq_channel_table *table;
+	emq_dict_entry *entry;
+	unsigned int hash;
+
+	entry = emq_dict_find(client->channel_subscriptions, name, emq_dict_hash(name));
+	if (!entry) {
+		return NULL;
+	}
+
+	table = entry->value;
+	hash = emq_dict_hash(channel);
+
+	if ((entry = emq_dict_find(table->topics, channel, hash)) == NULL) {
+		entry = emq_dict_find(table->patterns, channel, hash);
+	}
+
+	return entry ? entry->value : NULL;
+}
+
+void emq_channel_subscription_delete(emq_client *client, const char *name, const char *channel, int pattern)
+{
+	unsigned int hash = emq_dict_hash(name);
+	emq_channel_table *table;
+	emq_dict_entry *entry;
+
+	entry = emq_dict_find(client->channel_subscriptions, name, hash);
+	if (!entry) {
+		return;
+	}
+
+	table = entry->value;
+
+	emq_dict_delete(pattern ? table->patterns : table->topics, channel, emq_dict_hash(channel));
+
+	if (!EMQ_DICT_LENGTH(table->topics) && !EMQ_DICT_LENGTH(table->patterns)) {
+		emq_dict_delete(client->channel_subscriptions, name, hash);
+	}
+}
+
+emq_msg *emq_msg_create(void *data, size_t size, int zero_copy)
+{
+	emq_msg *msg;
+
+	msg = (emq_msg*)malloc(sizeof(*msg));
+	if (!msg) {
+		return NULL;
+	}
+
+	msg->size = size;
+	msg->tag = 0;
+	msg->expire = 0;
+	msg->zero_copy = zero_copy;
+	msg->pool = NULL;
+	msg->refcount = 1;
+	msg->shared = NULL;
+	msg->iov = NULL;
+	msg->iovcnt = 0;
+
+	if (!zero_copy) {
+		msg->data = malloc(size);
+		if (!msg->data) {
+			free(msg);
+			return NULL;
+		}
+		memcpy(msg->data, data, size);
+	} else {
+		msg->data = data;
+	}
+
+	return msg;
+}
+
+emq_msg *emq_msg_createv(const struct iovec *iov, int iovcnt)
+{
+	emq_msg *msg;
+	int i;
+
+	if (iovcnt < 1 || iovcnt > EMQ_MSG_IOV_MAX) {
+		return NULL;
+	}
+
+	msg = (emq_msg*)malloc(sizeof(*msg) + sizeof(struct iovec) * iovcnt);
+	if (!msg) {
+		return NULL;
+	}
+
+	msg->data = NULL;
+	msg->size = 0;
+	msg->tag = 0;
+	msg->expire = 0;
+	msg->zero_copy = EMQ_ZEROCOPY_ON;
+	msg->pool = NULL;
+	msg->refcount = 1;
+	msg->shared = NULL;
+	msg->iov = (struct iovec*)(msg + 1);
+	msg->iovcnt = iovcnt;
+
+	for (i = 0; i < iovcnt; i++) {
+		msg->iov[i] = iov[i];
+		msg->size += iov[i].iov_len;
+	}
+
+	return msg;
+}
+
+int emq_msg_iov(emq_msg *msg, struct iovec *iov)
+{
+	int i;
+
+	if (!msg->iovcnt) {
+		iov[0].iov_base = msg->data;
+		iov[0].iov_len = msg->size;
+		return 1;
+	}
+
+	for (i = 0; i < msg->iovcnt; i++) {
+		iov[i] = msg->iov[i];
+	}
+
+	return msg->iovcnt;
+}
+
+emq_msg *emq_msg_copy(emq_msg *msg)
+{
+	emq_msg *new_msg;
+	size_t pos = 0;
+	int i;
+
+	new_msg = emq_msg_pool_alloc(msg->pool, msg->size);
+	if (!new_msg) {
+		return NULL;
+	}
+
+	new_msg->tag = msg->tag;
+	new_msg->expire = msg->expire;
+
+	if (!msg->iovcnt) {
+		memcpy(new_msg->data, msg->data, msg->size);
+	}
+
+	for (i = 0; i < msg->iovcnt; i++) {
+		memcpy((char*)new_msg->data + pos, msg->iov[i].iov_base, msg->iov[i].iov_len);
+		pos += msg->iov[i].iov_len;
+	}
+
+	return new_msg;
+}
+
+emq_msg *emq_msg_share(emq_msg *msg)
+{
+	emq_msg *new_msg;
+
+	new_msg = (emq_msg*)malloc(sizeof(*new_msg));
+	if (!new_msg) {
+		return NULL;
+	}
+
+	new_msg->data = msg->data;
+	new_msg->size = msg->size;
+	new_msg->tag = msg->tag;
+	new_msg->expire = msg->expire;
+	new_msg->zero_copy = EMQ_ZEROCOPY_ON;
+	new_msg->pool = NULL;
+	new_msg->refcount = 1;
+	new_msg->shared = emq_msg_ref(msg->shared ? msg->shared : msg);
+	new_msg->iov = msg->iov;
+	new_msg->iovcnt = msg->iovcnt;
+
+	return new_msg;
+}
+
+emq_msg *emq_msg_ref(emq_msg *msg)
+{
+	__sync_add_and_fetch(&msg->refcount, 1);
+
+	return msg;
+}
+
+void emq_msg_unref(emq_msg *msg)
+{
+	emq_msg_release(msg);
+}
+
+void emq_msg_expire(emq_msg *msg, emq_time time)
+{
+	msg->expire = time;
+}
+
+void *emq_msg_data(emq_msg *msg)
+{
+	return msg->data;
+}
+
+size_t emq_msg_size(emq_msg *msg)
+{
+	return msg->size;
+}
+
+emq_tag emq_msg_tag(emq_msg *msg)
+{
+	return msg->tag;
+}
+
+void emq_msg_release(emq_msg *msg)
+{
+	if (__sync_sub_and_fetch(&msg->refcount, 1) > 0) {
+		return;
+	}
+
+	if (msg->shared) {
+		emq_msg_release(msg->shared);
+		free(msg);
+		return;
+	}
+
+	if (msg->pool) {
+		emq_msg_pool_free(msg);
+		return;
+	}
+
+	if (!msg->zero_copy) {
+		free(msg->data);
+	}
+
+	free(msg);
+}
+
+/* The endpoint is kept for emq_reconnect, a client without it can not be reconnected */
+static void emq_client_endpoint(emq_client *client, const char *addr, int port, int local)
+{
+	if (strlenz(addr) > sizeof(client->endpoint->addr)) {
+		return;
+	}
+
+	client->endpoint = (emq_endpoint*)calloc(1, sizeof(emq_endpoint));
+	if (!client->endpoint) {
+		return;
+	}
+
+	strcpy(client->endpoint->addr, addr);
+	client->endpoint->port = port;
+	client->endpoint->local = local;
+	emq_backoff_init(&client->endpoint->backoff, 0, 0, (uint32_t)emq_mstime() ^ (uint32_t)(uintptr_t)client);
+}
+
+emq_client *emq_tcp_connect(const char *addr, int port)
+{
+	emq_client *client = emq_client_init();
+
+	if (!client) {
+		return NULL;
+	}
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((emq_client_tcp_connect(client, addr, port)) == EMQ_NET_ERR) {
+		emq_client_release(client);
+		return NULL;
+	}
+
+	emq_client_endpoint(client, addr, port, 0);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return client;
+}
+
+emq_client *emq_unix_connect(const char *path)
+{
+	emq_client *client = emq_client_init();
+
+	if (!client) {
+		return NULL;
+	}
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((emq_client_unix_connect(client, path)) == EMQ_NET_ERR) {
+		emq_client_release(client);
+		return NULL;
+	}
+
+	emq_client_endpoint(client, path, 0, 1);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return client;
+}
+
+void emq_disconnect(emq_client *client)
 {
 	if (client != NULL) {
+		/* a callback can not wait for itself, the client is only released by the reader */
+		if (client->dispatch) {
+			if (emq_dispatch_in_callback()) {
+				return;
+			}
+
+			emq_dispatch_unlink(client);
+		}
+
+		/* no I/O here, the tags which were not flushed are dropped */
+		if (client->confirm && client->confirm->count) {
+			emq_queue_confirm_drop(client, client->confirm->count, EMQ_ERROR_WRITE);
+			client->confirm->count = 0;
+		}
+
 		emq_client_disconnect(client);
 		emq_client_release(client);
 	}
 }
 
-int emq_auth(emq_client *client, const char *name, const char *password)
+int emq_reconnect(emq_client *client)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	emq_msg *msg;
+	int status;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (!endpoint || EMQ_PIPELINE_ACTIVE(client)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	emq_client_disconnect(client);
+	client->input_pos = client->input_len = 0;
+
+	/* prefetched pops in flight were lost with the old connection, the buffered ones carry its tags */
+	if (client->prefetch) {
+		while ((msg = emq_prefetch_take(client->prefetch)) != NULL) {
+			emq_msg_release(msg);
+		}
+
+		client->prefetch->pending = 0;
+		client->prefetch->no_data = 0;
+	}
+
+	/* the deferred tags belong to the old connection and can not be confirmed on the new one */
+	if (client->confirm && client->confirm->count) {
+		emq_queue_confirm_drop(client, client->confirm->count, EMQ_ERROR_WRITE);
+		client->confirm->count = 0;
+	}
+
+	if (client->dispatch) {
+		emq_dispatch_drop(client);
+	}
+
+	/* the frames sent after the last barrier are unconfirmed, count them as a failed barrier */
+	if (client->window) {
+		if (client->window->pending) {
+			client->window->stats.failed++;
+		}
+
+		client->window->pending = 0;
+		client->window->last = emq_mstime();
+	}
+
+	status = endpoint->local ? emq_client_unix_connect(client, endpoint->addr) :
+		emq_client_tcp_connect(client, endpoint->addr, endpoint->port);
+
+	if (status == EMQ_NET_ERR) {
+		client->fd = -1;
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (emq_session_replay(client) == EMQ_STATUS_ERR) {
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+void emq_backoff_init(emq_backoff *backoff, uint32_t min_delay, uint32_t max_delay, uint32_t seed)
+{
+	/* a zero limit would never grow and the attempts would spin */
+	backoff->min_delay = min_delay ? min_delay : 1;
+	backoff->max_delay = max_delay > backoff->min_delay ? max_delay : backoff->min_delay;
+	backoff->limit = backoff->min_delay;
+	backoff->seed = seed ? seed : 1;
+}
+
+void emq_backoff_reset(emq_backoff *backoff)
+{
+	backoff->limit = backoff->min_delay;
+}
+
+/*
+ * Returns the delay before the next attempt and doubles the limit. The delay is random between
+ * half the current limit and the limit, so clients dropped by a server restart do not come back
+ * at once, and never below 1 millisecond, so the attempts do not spin.
+ */
+uint32_t emq_backoff_next(emq_backoff *backoff)
+{
+	uint32_t x = backoff->seed, delay, half;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	backoff->seed = x;
+	half = backoff->limit / 2;
+	delay = half + x % (backoff->limit - half + 1);
+
+	if (!delay) {
+		delay = 1;
+	}
+
+	backoff->limit = backoff->limit > backoff->max_delay / 2 ? backoff->max_delay : backoff->limit * 2;
+
+	return delay;
+}
+
+static int emq_reconnect_backoff(emq_client *client)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	int attempt;
+
+	emq_backoff_reset(&endpoint->backoff);
+
+	for (attempt = 0; attempt != endpoint->retries; attempt++)
+	{
+		if (attempt) {
+			poll(NULL, 0, (int)emq_backoff_next(&endpoint->backoff));
+		}
+
+		if (emq_reconnect(client) == EMQ_STATUS_OK) {
+			return EMQ_STATUS_OK;
+		}
+	}
+
+	return EMQ_STATUS_ERR;
+}
+
+int emq_auto_reconnect(emq_client *client, int retries, uint32_t min_delay, uint32_t max_delay)
+{
+	EMQ_CLEAR_ERROR(client);
+
+	if (!client->endpoint || retries < -1 || (min_delay ? min_delay : 1) > max_delay) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	client->endpoint->retries = retries;
+
+	if (!retries) {
+		memset(client->endpoint->name, 0, sizeof(client->endpoint->name));
+		memset(client->endpoint->password, 0, sizeof(client->endpoint->password));
+		client->endpoint->auth = 0;
+	}
+
+	emq_backoff_init(&client->endpoint->backoff, min_delay, max_delay, client->endpoint->backoff.seed);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+#define EMQ_CLIENT_ERROR_IS(client, code) ((client)->error_code == (code))
+
+/* A broken connection of a client with automatic reconnect is replaced and the session restored,
+   allocation and protocol errors are returned as they are */
+static int emq_process_recover(emq_client *client)
+{
+	if (!client->endpoint || !client->endpoint->retries) {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (!EMQ_CLIENT_ERROR_IS(client, EMQ_ERROR_READ) && !EMQ_CLIENT_ERROR_IS(client, EMQ_ERROR_WRITE)) {
+		return EMQ_STATUS_ERR;
+	}
+
+	return emq_reconnect_backoff(client);
+}
+
+/* Makes room for one more declared queue before the request is sent, so the declare can not be lost */
+static int emq_endpoint_reserve(emq_client *client)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	size_t capacity;
+	void *ptr;
+
+	if (endpoint->declared_count == endpoint->declared_capacity) {
+		capacity = endpoint->declared_capacity ? endpoint->declared_capacity * 2 : 8;
+
+		ptr = realloc(endpoint->declared, sizeof(*endpoint->declared) * capacity);
+		if (!ptr) {
+			return EMQ_STATUS_ERR;
+		}
+
+		endpoint->declared = (char(*)[64])ptr;
+		endpoint->declared_capacity = capacity;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static void emq_endpoint_declare(emq_client *client, const char *name)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	size_t i;
+
+	for (i = 0; i < endpoint->declared_count; i++) {
+		if (!strcmp(endpoint->declared[i], name)) {
+			return;
+		}
+	}
+
+	strcpy(endpoint->declared[endpoint->declared_count++], name);
+}
+
+static void emq_endpoint_forget(emq_client *client, const char *name)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	size_t i;
+
+	for (i = 0; i < endpoint->declared_count; i++) {
+		if (!strcmp(endpoint->declared[i], name)) {
+			memcpy(endpoint->declared[i], endpoint->declared[--endpoint->declared_count], 64);
+			return;
+		}
+	}
+}
+
+int emq_auth(emq_client *client, const char *name, const char *password)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_auth_request(client, name, password) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_AUTH, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	/* the credentials are kept in memory only for a client which reconnects */
+	if (client->endpoint && client->endpoint->retries) {
+		strcpy(client->endpoint->name, name);
+		strcpy(client->endpoint->password, password);
+		client->endpoint->auth = 1;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_ping(emq_client *client)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_ping_request(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_PING, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_stat(emq_client *client, emq_status *status)
+{
+	protocol_response_stat response;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_stat_request(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&response, sizeof(response)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_STAT, sizeof(response.body)) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
+
+	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&response.header));
+		goto error;
+	}
+
+	memcpy(status, &response.body, sizeof(*status));
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_save(emq_client *client, uint8_t async)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_save_request(client, async) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_SAVE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_flush(emq_client *client, uint32_t flags)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_flush_request(client, flags) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_FLUSH, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_user_create(emq_client *client, const char *name, const char *password, emq_perm perm)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_user_create_request(client, name, password, perm) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_CREATE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+emq_list *emq_user_list(emq_client *client)
+{
+	protocol_response_header header;
+	emq_user *user;
+	emq_list *list;
+	char *buffer;
+	uint32_t i;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_user_list_request(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_USER_LIST) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
+
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
+		goto error;
+	}
+
+	buffer = (char*)malloc(header.bodylen);
+	if (!buffer) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	if (emq_client_read(client, buffer, header.bodylen) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		free(buffer);
+		goto error;
+	}
+
+	list = emq_list_init();
+	if (!list) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		free(buffer);
+		goto error;
+	}
+
+	EMQ_LIST_SET_FREE_METHOD(list, emq_user_list_free_handler);
+
+	for (i = 0; i < header.bodylen;)
+	{
+		user = emq_user_init();
+		if (!user) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			emq_list_release(list);
+			free(buffer);
+			goto error;
+		}
+
+		memcpy(user->name, buffer + i, 32);
+		memcpy(user->password, buffer + i + 32, 32);
+		memcpy(&user->perm, buffer + i + 64, sizeof(uint64_t));
+		i += 64 + sizeof(uint64_t);
+
+		emq_list_add_value(list, user);
+	}
+
+	free(buffer);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return list;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return NULL;
+}
+
+int emq_user_rename(emq_client *client, const char *from, const char *to)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_user_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_RENAME, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_user_set_perm(emq_client *client, const char *name, emq_perm perm)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_user_set_perm_request(client, name, perm) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_SET_PERM, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_user_delete(emq_client *client, const char *name)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_user_delete_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_DELETE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_create(emq_client *client, const char *name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_create_request(client, name, max_msg, max_msg_size, flags) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_CREATE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_declare(emq_client *client, const char *name)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_declare_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (client->endpoint && emq_endpoint_reserve(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_DECLARE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	if (client->endpoint) {
+		emq_endpoint_declare(client, name);
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_exist(emq_client *client, const char *name)
+{
+	protocol_response_queue_exist response;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_exist_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_QUEUE_EXIST,
+			sizeof(response.body)) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
+
+	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&response.header));
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return response.body.status;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return 0;
+}
+
+emq_list *emq_queue_list(emq_client *client)
+{
+	protocol_response_header header;
+	emq_queue *queue;
+	emq_list *list;
+	char *buffer;
+	uint32_t i;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_list_request(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_LIST) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
+
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
+		goto error;
+	}
+
+	buffer = (char*)malloc(header.bodylen);
+	if (!buffer) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	if (emq_client_read(client, buffer, header.bodylen) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		free(buffer);
+		goto error;
+	}
+
+	list = emq_list_init();
+	if (!list) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		free(buffer);
+		goto error;
+	}
+
+	EMQ_LIST_SET_FREE_METHOD(list, emq_queue_list_free_handler);
+
+	for (i = 0; i < header.bodylen;)
+	{
+		queue = emq_queue_init();
+		if (!queue) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			emq_list_release(list);
+			free(buffer);
+			goto error;
+		}
+
+		memcpy(queue->name, buffer + i, 64);
+		i += 64;
+		memcpy(&queue->max_msg, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&queue->max_msg_size, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&queue->flags, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&queue->size, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&queue->declared_clients, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&queue->subscribed_clients, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+
+		emq_list_add_value(list, queue);
+	}
+
+	free(buffer);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return list;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return NULL;
+}
+
+int emq_queue_rename(emq_client *client, const char *from, const char *to)
+{
+	protocol_response_header header;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_RENAME, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_size(emq_client *client, const char *name)
+{
+	protocol_response_queue_size response;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_size_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_QUEUE_SIZE,
+			sizeof(response.body)) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
+
+	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&response.header));
+		goto error;
+	}
+
+	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return response.body.size;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return -1;
+}
+
+int emq_queue_push(emq_client *client, const char *name, emq_msg *msg)
+{
+	protocol_response_header header;
+	struct iovec data[2 + EMQ_MSG_IOV_MAX];
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (msg->size < 1) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_queue_push_request(client, name, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (EMQ_PIPELINE_ACTIVE(client)) {
+		if (emq_pipeline_append(client, EMQ_PROTOCOL_CMD_QUEUE_PUSH, &msg->expire,
+				sizeof(msg->expire), msg) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	data[0].iov_base = client->request;
+	data[0].iov_len = client->pos;
+	data[1].iov_base = &msg->expire;
+	data[1].iov_len = sizeof(msg->expire);
+
+	if (emq_client_writev(client, data, 2 + emq_msg_iov(msg, data + 2)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
+	}
+
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
+
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_PUSH, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
+
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
+	}
+
+	if (client->window && client->noack) {
+		emq_noack_sent(client, 1);
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_push_batch(emq_client *client, const char *name, emq_msg **msgs, size_t count, int *statuses)
+{
+	int pipeline = EMQ_PIPELINE_ACTIVE(client);
+	size_t pipeline_count = 0;
+	size_t pipeline_pos = 0;
+	int code;
+	size_t i;
+
+	EMQ_CLEAR_ERROR(client);
+
+	for (i = 0; i < count; i++)
+	{
+		if (!msgs[i] || msgs[i]->size < 1) {
+			code = EMQ_ERROR_DATA;
+			goto error_statuses;
+		}
+	}
+
+	if (!count) {
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	if (pipeline) {
+		pipeline_count = client->pipeline->count;
+		pipeline_pos = client->pipeline->pos;
+	} else if (emq_pipeline_begin(client) == EMQ_STATUS_ERR) {
+		code = EMQ_ERROR_ALLOC;
+		goto error_statuses;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (emq_queue_push_request(client, name, sizeof(msgs[i]->expire) + msgs[i]->size) == EMQ_STATUS_ERR) {
+			code = EMQ_ERROR_DATA;
+			goto error_discard;
+		}
+
+		if (emq_pipeline_append(client, EMQ_PROTOCOL_CMD_QUEUE_PUSH, &msgs[i]->expire,
+				sizeof(msgs[i]->expire), msgs[i]) == EMQ_STATUS_ERR) {
+			code = EMQ_ERROR_ALLOC;
+			goto error_discard;
+		}
+	}
+
+	if (pipeline) {
+		emq_pipeline_set_statuses(statuses, 0, count, EMQ_ERROR_NONE);
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	return emq_pipeline_exec(client, statuses);
+
+error_discard:
+	if (pipeline) {
+		emq_pipeline_truncate(client->pipeline, pipeline_count, pipeline_pos);
+	} else {
+		emq_pipeline_reset(client->pipeline);
+	}
+
+error_statuses:
+	emq_pipeline_set_statuses(statuses, 0, count, code);
+	emq_client_set_error(client, code);
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+static emq_msg *emq_read_message(emq_client *client, size_t size)
+{
+	emq_msg *msg;
+
+	msg = emq_msg_pool_alloc(client->msg_pool, size);
+	if (!msg) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		return NULL;
+	}
+
+	if (emq_client_read(client, (char*)msg->data, msg->size) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		emq_msg_release(msg);
+		return NULL;
+	}
+
+	return msg;
+}
+
+static emq_msg *emq_read_message_tag(emq_client *client, size_t size)
+{
+	emq_msg *msg;
+	uint64_t tag;
+
+	if (size < sizeof(tag)) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return NULL;
+	}
+
+	if (emq_client_read(client, (char*)&tag, sizeof(tag)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return NULL;
+	}
+
+	if ((msg = emq_read_message(client, size - sizeof(tag))) == NULL) {
+		return NULL;
+	}
+
+	msg->tag = tag;
+
+	return msg;
+}
+
+/* Only the first request waits for the timeout, so an empty queue blocks for one timeout, not count */
+static int emq_queue_pop_write(emq_client *client, const char *name, emq_time timeout, size_t count)
+{
+	struct iovec data[EMQ_DEFAULT_PIPELINE_SIZE];
+	size_t i, n;
+
+	if (timeout && count > 0)
+	{
+		if (emq_queue_pop_request(client, name, timeout) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_DATA);
+			return EMQ_STATUS_ERR;
+		}
+
+		if (emq_client_write(client, client->request, client->pos) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_WRITE);
+			return EMQ_STATUS_ERR;
+		}
+
+		count--;
+	}
+
+	if (emq_queue_pop_request(client, name, 0) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		return EMQ_STATUS_ERR;
+	}
+
+	while (count > 0)
+	{
+		n = count > EMQ_DEFAULT_PIPELINE_SIZE ? EMQ_DEFAULT_PIPELINE_SIZE : count;
+
+		for (i = 0; i < n; i++) {
+			data[i].iov_base = client->request;
+			data[i].iov_len = client->pos;
+		}
+
+		if (emq_client_writev(client, data, n) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_WRITE);
+			return EMQ_STATUS_ERR;
+		}
+
+		count -= n;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+/* Returns EMQ_ERROR_* of the response or -1 if the connection is broken */
+static int emq_queue_pop_read(emq_client *client, emq_msg **msg)
+{
+	protocol_response_header header;
+	int code;
+
+	*msg = NULL;
+
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return -1;
+	}
+
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_POP) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return -1;
+	}
+
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		code = emq_get_error(&header);
+		return (code == EMQ_ERROR_NONE) ? EMQ_ERROR_RESPONSE : code;
+	}
+
+	if ((*msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
+		return -1;
+	}
+
+	return EMQ_ERROR_NONE;
+}
+
+static int emq_queue_prefetch_receive(emq_client *client, int all)
+{
+	emq_prefetch *prefetch = client->prefetch;
+	emq_msg *msg;
+	int code;
+
+	while (prefetch->pending > 0 && (all || !EMQ_PREFETCH_LENGTH(prefetch)))
+	{
+		code = emq_queue_pop_read(client, &msg);
+		if (code == -1) {
+			return EMQ_STATUS_ERR;
+		}
+
+		prefetch->pending--;
+
+		if (code != EMQ_ERROR_NONE) {
+			prefetch->no_data = 1;
+			continue;
+		}
+
+		if (emq_prefetch_push(prefetch, msg) == EMQ_STATUS_ERR) {
+			emq_msg_release(msg);
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_queue_prefetch_send(emq_client *client)
+{
+	emq_prefetch *prefetch = client->prefetch;
+	size_t used = prefetch->pending + EMQ_PREFETCH_LENGTH(prefetch);
+
+	if (prefetch->no_data || used >= prefetch->window) {
+		return EMQ_STATUS_OK;
+	}
+
+	if (emq_queue_pop_write(client, prefetch->name, prefetch->timeout, prefetch->window - used) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
+
+	prefetch->pending += prefetch->window - used;
+
+	return EMQ_STATUS_OK;
+}
+
+/* Reads the responses of the prefetch window, must be called before a request is built */
+static int emq_queue_prefetch_drain(emq_client *client)
+{
+	if (!client->prefetch->pending) {
+		return EMQ_STATUS_OK;
+	}
+
+	return emq_queue_prefetch_receive(client, 1);
+}
+
+int emq_queue_prefetch(emq_client *client, const char *name, emq_time timeout, size_t window)
+{
+	emq_prefetch *prefetch;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (strlenz(name) > sizeof(prefetch->name)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (!client->prefetch) {
+		client->prefetch = emq_prefetch_create();
+		if (!client->prefetch) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+	}
+
+	prefetch = client->prefetch;
+
+	if (emq_queue_prefetch_receive(client, 1) == EMQ_STATUS_ERR) {
+		goto error;
+	}
+
+	if (EMQ_PREFETCH_LENGTH(prefetch) && !EMQ_PREFETCH_MATCH(client, name, timeout)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	memcpy(prefetch->name, name, strlenz(name));
+	prefetch->timeout = timeout;
+	prefetch->window = window;
+	prefetch->no_data = 0;
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+typedef struct emq_drain_event {
+	struct emq_drain_event *next;
+	protocol_event_header header;
+	char body[1];
+} emq_drain_event;
+
+void emq_drain_mark(emq_drain *drain)
+{
+	if (drain->inflight) {
+		drain->again = 1;
+		return;
+	}
+
+	if (!drain->pending) {
+		drain->next = drain->client->drains;
+		drain->client->drains = drain;
+		drain->pending = 1;
+	}
+}
+
+static void emq_drain_unlink(emq_drain *drain)
+{
+	emq_drain **link = &drain->client->drains;
+
+	while (*link) {
+		if (*link == drain) {
+			*link = drain->next;
+			break;
+		}
+
+		link = &(*link)->next;
+	}
+
+	drain->next = NULL;
+	drain->pending = 0;
+}
+
+void emq_drain_release(emq_drain *drain)
+{
+	if (drain->pending) {
+		emq_drain_unlink(drain);
+	}
+
+	drain->subscription = NULL;
+
+	if (drain->inflight) {
+		drain->released = 1;
+		return;
+	}
+
+	free(drain);
+}
+
+/* Reads the next response header, stashing the events received before it */
+static int emq_response_stash(emq_client *client, protocol_response_header *header, emq_drain_event **tail)
+{
+	emq_drain_event *event;
+
+	for (;;)
+	{
+		if (emq_client_read(client, (char*)header, sizeof(*header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			return -1;
+		}
+
+		if (header->magic != EMQ_PROTOCOL_EVENT) {
+			return 0;
+		}
+
+		if (header->bodylen > EMQ_MAX_REQUEST_SIZE) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			return -1;
+		}
+
+		event = (emq_drain_event*)malloc(sizeof(*event) + header->bodylen);
+		if (!event) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			return -1;
+		}
+
+		event->next = NULL;
+		memcpy(&event->header, header, sizeof(*header));
+
+		if (emq_client_read(client, event->body, header->bodylen) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			free(event);
+			return -1;
+		}
+
+		(*tail)->next = event;
+		*tail = event;
+	}
+}
+
+/* Reads one QUEUE_POP response, stashing the events received before it.
+   Returns EMQ_ERROR_* of the response or -1 if the connection is broken */
+static int emq_drain_read(emq_client *client, emq_drain_event **tail, emq_msg **msg)
+{
+	protocol_response_header header;
+	int code;
+
+	*msg = NULL;
+
+	if (emq_response_stash(client, &header, tail) == -1) {
+		return -1;
+	}
+
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_POP) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return -1;
+	}
+
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		code = emq_get_error(&header);
+		return (code == EMQ_ERROR_NONE) ? EMQ_ERROR_RESPONSE : code;
+	}
+
+	if ((*msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
+		return -1;
+	}
+
+	return EMQ_ERROR_NONE;
+}
+
+static int emq_drain_queue(emq_client *client, emq_drain *drain, emq_drain_event **tail)
+{
+	emq_msg *msgs[EMQ_DEFAULT_PIPELINE_SIZE];
+	size_t i, n, received;
+	int more = 1, stop = 0;
+	int code;
+
+	while (more && !drain->released)
+	{
+		n = drain->batch > EMQ_DEFAULT_PIPELINE_SIZE ? EMQ_DEFAULT_PIPELINE_SIZE : drain->batch;
+
+		if (emq_queue_pop_write(client, drain->subscription->name, drain->timeout, n) == EMQ_STATUS_ERR) {
+			return -1;
+		}
+
+		for (i = 0, received = 0; i < n; i++)
+		{
+			code = emq_drain_read(client, tail, &msgs[received]);
+			if (code == -1) {
+				while (received > 0) {
+					emq_msg_release(msgs[--received]);
+				}
+				return -1;
+			}
+
+			if (code == EMQ_ERROR_NONE) {
+				received++;
+			} else {
+				more = 0;
+			}
+		}
+
+		for (i = 0; i < received; i++)
+		{
+			if (drain->released) {
+				emq_msg_release(msgs[i]);
+			} else if (emq_queue_deliver(client, drain->subscription, msgs[i])) {
+				stop = 1;
+			}
+		}
+	}
+
+	return stop;
+}
+
+int emq_drain_flush(emq_client *client)
+{
+	emq_drain_event head, *tail, *event;
+	emq_drain *drain;
+	int status, stop = 0;
+
+	while ((drain = client->drains) != NULL)
+	{
+		emq_drain_unlink(drain);
+
+		head.next = NULL;
+		tail = &head;
+
+		drain->inflight = 1;
+		status = emq_drain_queue(client, drain, &tail);
+		drain->inflight = 0;
+
+		if (drain->released) {
+			free(drain);
+		} else if (drain->again) {
+			drain->again = 0;
+			emq_drain_mark(drain);
+		}
+
+		while ((event = head.next) != NULL)
+		{
+			head.next = event->next;
+
+			if (status != -1) {
+				switch (emq_event_dispatch(client, &event->header, event->body))
+				{
+					case 0: break;
+					case 1: stop = 1; break;
+					default: status = -1; break;
+				}
+			}
+
+			free(event);
+		}
+
+		if (status == -1) {
+			return -1;
+		}
+
+		if (status == 1) {
+			stop = 1;
+		}
+	}
+
+	return stop && EMQ_DICT_LENGTH(client->queue_subscriptions) == 0;
+}
+
+static int emq_session_append(emq_client *client, uint8_t cmd, int status)
+{
+	if (status == EMQ_STATUS_ERR || emq_pipeline_append(client, cmd, NULL, 0, NULL) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_session_channels(emq_client *client, emq_dict *subscriptions, int pattern)
+{
+	emq_channel_subscription *subscription;
+	emq_dict_iterator iter;
+	emq_dict_entry *entry;
+
+	emq_dict_rewind(subscriptions, &iter);
+
+	while ((entry = emq_dict_next(&iter)) != NULL)
+	{
+		subscription = (emq_channel_subscription*)entry->value;
+
+		if (pattern ? emq_session_append(client, EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE,
+				emq_channel_psubscribe_request(client, subscription->name, subscription->channel)) :
+			emq_session_append(client, EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE,
+				emq_channel_subscribe_request(client, subscription->name, subscription->channel))) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+static int emq_session_write(emq_client *client)
+{
+	emq_endpoint *endpoint = client->endpoint;
+	emq_queue_subscription *queue;
+	emq_channel_table *table;
+	emq_dict_iterator iter;
+	emq_dict_entry *entry;
+	size_t i;
+
+	if (endpoint->auth && emq_session_append(client, EMQ_PROTOCOL_CMD_AUTH,
+			emq_auth_request(client, endpoint->name, endpoint->password))) {
+		return EMQ_STATUS_ERR;
+	}
+
+	for (i = 0; i < endpoint->declared_count; i++) {
+		if (emq_session_append(client, EMQ_PROTOCOL_CMD_QUEUE_DECLARE,
+				emq_queue_declare_request(client, endpoint->declared[i]))) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	emq_dict_rewind(client->queue_subscriptions, &iter);
+
+	while ((entry = emq_dict_next(&iter)) != NULL)
+	{
+		queue = (emq_queue_subscription*)entry->value;
+
+		if (emq_session_append(client, EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE,
+				emq_queue_subscribe_request(client, queue->name, queue->flags))) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	emq_dict_rewind(client->channel_subscriptions, &iter);
+
+	while ((entry = emq_dict_next(&iter)) != NULL)
+	{
+		table = (emq_channel_table*)entry->value;
+
+		if (emq_session_channels(client, table->topics, 0) == EMQ_STATUS_ERR ||
+			emq_session_channels(client, table->patterns, 1) == EMQ_STATUS_ERR) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+/*
+ * Restores the session of a reconnected client with a single write: authentication,
+ * declared queues and subscriptions. Events which arrive between the responses are
+ * dispatched once every response is read.
+ */
+static int emq_session_replay(emq_client *client)
 {
 	protocol_response_header header;
+	emq_drain_event head, *tail, *event;
+	emq_pipeline *pipeline;
+	int noack = client->noack;
+	int status = 0, code, failed = EMQ_ERROR_NONE;
+	size_t i;
 
-	EMQ_CLEAR_ERROR(client);
+	if (emq_pipeline_begin(client) == EMQ_STATUS_ERR) {
+		return EMQ_STATUS_ERR;
+	}
 
-	if (emq_auth_request(client, name, password) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	pipeline = client->pipeline;
+
+	client->noack = 0;
+	status = emq_session_write(client);
+	client->noack = noack;
+
+	if (status == EMQ_STATUS_ERR) {
+		emq_pipeline_reset(pipeline);
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		return EMQ_STATUS_ERR;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
+	if (pipeline->count && emq_client_write(client, pipeline->buffer, (int)pipeline->pos) == -1) {
+		emq_pipeline_reset(pipeline);
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
+		return EMQ_STATUS_ERR;
 	}
 
-	if (!client->noack)
+	head.next = NULL;
+	tail = &head;
+	status = 0;
+
+	for (i = 0; i < pipeline->count; i++)
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+		if (emq_response_stash(client, &header, &tail) == -1) {
+			status = -1;
+			break;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_AUTH, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, pipeline->commands[i].cmd, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+			status = -1;
+			break;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR && !failed) {
+			code = emq_get_error(&header);
+			failed = (code == EMQ_ERROR_NONE) ? EMQ_ERROR_RESPONSE : code;
 		}
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	emq_pipeline_reset(pipeline);
 
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	while ((event = head.next) != NULL)
+	{
+		head.next = event->next;
+
+		if (status != -1 && emq_event_dispatch(client, &event->header, event->body) == -1) {
+			status = -1;
+		}
+
+		free(event);
+	}
+
+	if (status == -1) {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (failed) {
+		emq_client_set_error(client, failed);
+		return EMQ_STATUS_ERR;
+	}
+
+	return EMQ_STATUS_OK;
 }
 
-int emq_ping(emq_client *client)
+int emq_queue_drain(emq_client *client, const char *name, emq_time timeout, size_t batch)
 {
-	protocol_response_header header;
+	emq_queue_subscription *subscription;
+	emq_drain *drain;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_ping_request(client) == EMQ_STATUS_ERR) {
+	if ((subscription = emq_queue_subscription_find(client, name)) == NULL) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+	if (!batch) {
+		if (subscription->drain) {
+			emq_drain_release(subscription->drain);
+			subscription->drain = NULL;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_PING, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
-		}
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+	if (!subscription->drain) {
+		drain = (emq_drain*)calloc(1, sizeof(*drain));
+		if (!drain) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
 			goto error;
 		}
+
+		drain->client = client;
+		drain->subscription = subscription;
+		subscription->drain = drain;
 	}
 
+	subscription->drain->timeout = timeout;
+	subscription->drain->batch = batch;
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -610,13 +3533,18 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_stat(emq_client *client, emq_status *status)
+emq_msg *emq_queue_get(emq_client *client, const char *name)
 {
-	protocol_response_stat response;
+	protocol_response_header header;
+	emq_msg *msg;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_stat_request(client) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_get_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -626,38 +3554,67 @@ int emq_stat(emq_client *client, emq_status *status)
 		goto error;
 	}
 
-	if (emq_client_read(client, (char*)&response, sizeof(response)) == -1) {
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_READ);
 		goto error;
 	}
 
-	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_STAT, sizeof(response.body)) == EMQ_STATUS_ERR) {
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_GET) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 		goto error;
 	}
 
-	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&response.header));
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
 		goto error;
 	}
 
-	memcpy(status, &response.body, sizeof(*status));
+	if ((msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
+		goto error;
+	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	return msg;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	return NULL;
 }
 
-int emq_save(emq_client *client, uint8_t async)
+emq_msg *emq_queue_pop(emq_client *client, const char *name, emq_time timeout)
 {
 	protocol_response_header header;
+	emq_msg *msg;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_save_request(client, async) == EMQ_STATUS_ERR) {
+	if (emq_queue_confirm_expire(client) == EMQ_STATUS_ERR) {
+		goto error;
+	}
+
+	if (EMQ_PREFETCH_MATCH(client, name, timeout))
+	{
+		if (emq_queue_prefetch_receive(client, 0) == EMQ_STATUS_ERR) {
+			goto error;
+		}
+
+		if ((msg = emq_prefetch_take(client->prefetch)) != NULL)
+		{
+			if (emq_queue_prefetch_send(client) == EMQ_STATUS_ERR) {
+				emq_prefetch_untake(client->prefetch, msg);
+				goto error;
+			}
+
+			EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+			return msg;
+		}
+	}
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_pop_request(client, name, timeout) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -667,127 +3624,207 @@ int emq_save(emq_client *client, uint8_t async)
 		goto error;
 	}
 
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_SAVE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
-		}
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_POP) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
+		goto error;
+	}
+
+	if ((msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
+		goto error;
+	}
+
+	if (EMQ_PREFETCH_MATCH(client, name, timeout))
+	{
+		client->prefetch->no_data = 0;
+
+		if (emq_queue_prefetch_send(client) == EMQ_STATUS_ERR) {
+			if (emq_prefetch_push(client->prefetch, msg) == EMQ_STATUS_ERR) {
+				emq_msg_release(msg);
+			}
 			goto error;
 		}
 	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	return msg;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	return NULL;
 }
 
-int emq_flush(emq_client *client, uint32_t flags)
+int emq_queue_pop_batch(emq_client *client, const char *name, emq_time timeout, emq_msg **msgs, size_t count)
 {
-	protocol_response_header header;
+	int prefetch = EMQ_PREFETCH_MATCH(client, name, timeout);
+	size_t received = 0;
+	size_t i, n;
+	int no_data = 0;
+	int failed = 0;
+	int code;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_flush_request(client, flags) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (emq_queue_confirm_expire(client) == EMQ_STATUS_ERR) {
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
+	if (prefetch)
+	{
+		if (emq_queue_prefetch_receive(client, 1) == EMQ_STATUS_ERR) {
+			goto error;
+		}
+
+		while (received < count && (msgs[received] = emq_prefetch_take(client->prefetch)) != NULL) {
+			received++;
+		}
+	}
+
+	if (received < count && EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (!client->noack)
+	while (received < count && !no_data && !failed)
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+		n = count - received;
+		if (n > EMQ_DEFAULT_PIPELINE_SIZE) {
+			n = EMQ_DEFAULT_PIPELINE_SIZE;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_FLUSH, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		if (emq_queue_pop_write(client, name, timeout, n) == EMQ_STATUS_ERR) {
 			goto error;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+		for (i = 0; i < n; i++)
+		{
+			code = emq_queue_pop_read(client, &msgs[received]);
+			if (code == -1) {
+				goto error;
+			}
+
+			if (code == EMQ_ERROR_NONE) {
+				received++;
+			} else if (code == EMQ_ERROR_NO_DATA) {
+				no_data = 1;
+			} else if (!failed++) {
+				emq_client_set_error(client, code);
+			}
+		}
+	}
+
+	if (failed) {
+		goto error;
+	}
+
+	if (prefetch && !no_data) {
+		client->prefetch->no_data = 0;
+
+		if (emq_queue_prefetch_send(client) == EMQ_STATUS_ERR) {
 			goto error;
 		}
 	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	return (int)received;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	return received ? (int)received : EMQ_STATUS_ERR;
 }
 
-int emq_user_create(emq_client *client, const char *name, const char *password, emq_perm perm)
+/* On truncation the whole message is stored in rest when it is not NULL and memory allows */
+static int emq_queue_read_into(emq_client *client, uint8_t cmd, void *data, size_t size,
+	size_t *msg_size, emq_tag *tag, emq_msg **rest)
 {
 	protocol_response_header header;
+	uint64_t msg_tag;
+	size_t length;
+	emq_msg *msg;
 
-	EMQ_CLEAR_ERROR(client);
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return EMQ_STATUS_ERR;
+	}
 
-	if (emq_user_create_request(client, name, password, perm) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	if (emq_check_response_header_mini(&header, cmd) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return EMQ_STATUS_ERR;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
+		return EMQ_STATUS_ERR;
 	}
 
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+	if (header.bodylen < sizeof(msg_tag)) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return EMQ_STATUS_ERR;
+	}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_CREATE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+	if (emq_client_read(client, (char*)&msg_tag, sizeof(msg_tag)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return EMQ_STATUS_ERR;
+	}
+
+	length = header.bodylen - sizeof(msg_tag);
+
+	if (msg_size) {
+		*msg_size = length;
+	}
+
+	if (tag) {
+		*tag = msg_tag;
+	}
+
+	if (emq_client_read(client, (char*)data, length > size ? size : length) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (length > size) {
+		msg = rest ? emq_msg_pool_alloc(client->msg_pool, length) : NULL;
+
+		if (msg) {
+			memcpy(msg->data, data, size);
+			msg->tag = msg_tag;
+
+			if (emq_client_read(client, (char*)msg->data + size, length - size) == -1) {
+				emq_msg_release(msg);
+				emq_client_set_error(client, EMQ_ERROR_READ);
+				return EMQ_STATUS_ERR;
+			}
+
+			*rest = msg;
+		} else if (emq_client_skip(client, length - size) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			return EMQ_STATUS_ERR;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
-		}
+		emq_client_set_error(client, EMQ_ERROR_TRUNCATED);
+		return EMQ_STATUS_ERR;
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
-
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
 }
 
-emq_list *emq_user_list(emq_client *client)
+int emq_queue_get_into(emq_client *client, const char *name, void *data, size_t size, size_t *msg_size, emq_tag *tag)
 {
-	protocol_response_header header;
-	emq_user *user;
-	emq_list *list;
-	char *buffer;
-	uint32_t i;
-
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_user_list_request(client) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_get_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -797,77 +3834,70 @@ emq_list *emq_user_list(emq_client *client)
 		goto error;
 	}
 
-	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
+	if (emq_queue_read_into(client, EMQ_PROTOCOL_CMD_QUEUE_GET, data, size, msg_size, tag, NULL) == EMQ_STATUS_ERR) {
 		goto error;
 	}
 
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_USER_LIST) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
 
-	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&header));
-		goto error;
-	}
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
 
-	buffer = (char*)malloc(header.bodylen);
-	if (!buffer) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		goto error;
-	}
+int emq_queue_pop_into(emq_client *client, const char *name, emq_time timeout, void *data, size_t size,
+	size_t *msg_size, emq_tag *tag)
+{
+	emq_msg *msg;
 
-	if (emq_client_read(client, buffer, header.bodylen) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		free(buffer);
-		goto error;
-	}
+	EMQ_CLEAR_ERROR(client);
 
-	list = emq_list_init();
-	if (!list) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		free(buffer);
+	if (emq_queue_confirm_expire(client) == EMQ_STATUS_ERR) {
 		goto error;
 	}
 
-	EMQ_LIST_SET_FREE_METHOD(list, emq_user_list_free_handler);
-
-	for (i = 0; i < header.bodylen;)
+	if (EMQ_PREFETCH_MATCH(client, name, timeout))
 	{
-		user = emq_user_init();
-		if (!user) {
-			emq_client_set_error(client, EMQ_ERROR_ALLOC);
-			emq_list_release(list);
-			free(buffer);
+		if (emq_queue_prefetch_receive(client, 0) == EMQ_STATUS_ERR) {
 			goto error;
 		}
 
-		memcpy(user->name, buffer + i, 32);
-		memcpy(user->password, buffer + i + 32, 32);
-		memcpy(&user->perm, buffer + i + 64, sizeof(uint64_t));
-		i += 64 + sizeof(uint64_t);
+		if ((msg = emq_prefetch_take(client->prefetch)) != NULL)
+		{
+			if (emq_queue_prefetch_send(client) == EMQ_STATUS_ERR) {
+				emq_prefetch_untake(client->prefetch, msg);
+				goto error;
+			}
 
-		emq_list_add_value(list, user);
-	}
+			memcpy(data, msg->data, msg->size > size ? size : msg->size);
 
-	free(buffer);
+			if (msg_size) {
+				*msg_size = msg->size;
+			}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return list;
+			if (tag) {
+				*tag = msg->tag;
+			}
 
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return NULL;
-}
+			if (msg->size > size) {
+				emq_prefetch_untake(client->prefetch, msg);
+				emq_client_set_error(client, EMQ_ERROR_TRUNCATED);
+				goto error;
+			}
 
-int emq_user_rename(emq_client *client, const char *from, const char *to)
-{
-	protocol_response_header header;
+			emq_msg_release(msg);
 
-	EMQ_CLEAR_ERROR(client);
+			EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+			return EMQ_STATUS_OK;
+		}
+	}
 
-	if (emq_user_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_pop_request(client, name, timeout) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -877,20 +3907,20 @@ int emq_user_rename(emq_client *client, const char *from, const char *to)
 		goto error;
 	}
 
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+	msg = NULL;
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_RENAME, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+	if (emq_queue_read_into(client, EMQ_PROTOCOL_CMD_QUEUE_POP, data, size, msg_size, tag,
+		EMQ_PREFETCH_MATCH(client, name, timeout) ? &msg : NULL) == EMQ_STATUS_ERR) {
+		if (msg && emq_prefetch_push(client->prefetch, msg) == EMQ_STATUS_ERR) {
+			emq_msg_release(msg);
 		}
+		goto error;
+	}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+	if (EMQ_PREFETCH_MATCH(client, name, timeout)) {
+		client->prefetch->no_data = 0;
+
+		if (emq_queue_prefetch_send(client) == EMQ_STATUS_ERR) {
 			goto error;
 		}
 	}
@@ -903,13 +3933,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_user_set_perm(emq_client *client, const char *name, emq_perm perm)
+int emq_queue_confirm(emq_client *client, const char *name, emq_tag tag)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_user_set_perm_request(client, name, perm) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_confirm_request(client, name, tag) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -926,7 +3960,7 @@ int emq_user_set_perm(emq_client *client, const char *name, emq_perm perm)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_SET_PERM, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_CONFIRM) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -945,40 +3979,22 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_user_delete(emq_client *client, const char *name)
+int emq_queue_confirm_setup(emq_client *client, size_t count, uint32_t delay, emq_confirm_callback *callback)
 {
-	protocol_response_header header;
-
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_user_delete_request(client, name) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
-
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_USER_DELETE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
-		}
-
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+	if (!client->confirm) {
+		client->confirm = emq_confirm_create();
+		if (!client->confirm) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
 			goto error;
 		}
 	}
 
+	client->confirm->max_count = count;
+	client->confirm->max_delay = delay;
+	client->confirm->callback = callback;
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -987,38 +4003,52 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_create(emq_client *client, const char *name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
+int emq_queue_confirm_defer(emq_client *client, const char *name, emq_tag tag)
 {
-	protocol_response_header header;
+	emq_confirm *confirm;
+	size_t capacity;
+	void *ptr;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_create_request(client, name, max_msg, max_msg_size, flags) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	if (!client->confirm) {
+		client->confirm = emq_confirm_create();
+		if (!client->confirm) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
+	confirm = client->confirm;
+
+	if (emq_queue_confirm_request(client, name, tag) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (!client->noack)
+	if (confirm->count == confirm->capacity)
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+		capacity = confirm->capacity ? confirm->capacity * 2 : EMQ_DEFAULT_CONFIRM_COUNT;
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_CREATE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		ptr = realloc(confirm->requests, sizeof(protocol_request_queue_confirm) * capacity);
+		if (!ptr) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
 			goto error;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
-		}
+		confirm->requests = (protocol_request_queue_confirm*)ptr;
+		confirm->capacity = capacity;
+	}
+
+	if (!confirm->count) {
+		confirm->first = emq_mstime();
+	}
+
+	memcpy(&confirm->requests[confirm->count++], client->request, sizeof(protocol_request_queue_confirm));
+
+	if (confirm->count >= confirm->max_count ||
+		emq_mstime() - confirm->first >= confirm->max_delay) {
+		return emq_queue_confirm_flush(client);
 	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
@@ -1029,40 +4059,88 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_declare(emq_client *client, const char *name)
+/* Reports the deferred tags which were never sent to the confirm callback */
+static void emq_queue_confirm_drop(emq_client *client, size_t count, int error)
+{
+	emq_confirm *confirm = client->confirm;
+	size_t i;
+
+	if (confirm->callback) {
+		for (i = 0; i < count; i++) {
+			confirm->callback(client, confirm->requests[i].body.name, confirm->requests[i].body.tag, error);
+		}
+	}
+}
+
+int emq_queue_confirm_flush(emq_client *client)
 {
 	protocol_response_header header;
+	protocol_request_queue_confirm *request;
+	emq_confirm *confirm = client->confirm;
+	int failed = 0;
+	size_t count;
+	int code;
+	size_t i;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_declare_request(client, name) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (!confirm || !confirm->count) {
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
+	count = confirm->count;
+	confirm->count = 0;
+
+	if (emq_client_write(client, (char*)confirm->requests, sizeof(protocol_request_queue_confirm) * count) == -1) {
+		emq_queue_confirm_drop(client, count, EMQ_ERROR_WRITE);
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
 
-	if (!client->noack)
+	for (i = 0; i < count; i++)
 	{
+		request = &confirm->requests[i];
+
+		if (request->header.noack) {
+			continue;
+		}
+
 		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
 			emq_client_set_error(client, EMQ_ERROR_READ);
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_DECLARE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_CONFIRM) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR)
+		{
+			code = emq_get_error(&header);
+			if (code == EMQ_ERROR_NONE) {
+				code = EMQ_ERROR_RESPONSE;
+			}
+
+			if (!failed++) {
+				emq_client_set_error(client, code);
+			}
+
+			if (confirm->callback) {
+				confirm->callback(client, request->body.name, request->body.tag, code);
+			}
 		}
 	}
 
+	if (failed) {
+		goto error;
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -1071,152 +4149,121 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_exist(emq_client *client, const char *name)
+int emq_queue_subscribe(emq_client *client, const char *name, uint32_t flags, emq_msg_callback *callback)
 {
-	protocol_response_queue_exist response;
+	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_exist_request(client, name) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_QUEUE_EXIST,
-			sizeof(response.body)) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+	if (!callback) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&response.header));
+	if (emq_queue_subscribe_request(client, name, flags) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return response.body.status;
-
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return 0;
-}
-
-emq_list *emq_queue_list(emq_client *client)
-{
-	protocol_response_header header;
-	emq_queue *queue;
-	emq_list *list;
-	char *buffer;
-	uint32_t i;
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
 
-	EMQ_CLEAR_ERROR(client);
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
 
-	if (emq_queue_list_request(client) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
+	if (emq_queue_subscription_add(client, name, flags, callback) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
 		goto error;
 	}
 
-	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
 
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_LIST) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
 
-	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&header));
-		goto error;
-	}
+int emq_queue_unsubscribe(emq_client *client, const char *name)
+{
+	protocol_response_header header;
 
-	buffer = (char*)malloc(header.bodylen);
-	if (!buffer) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_client_read(client, buffer, header.bodylen) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		free(buffer);
+	if (emq_queue_unsubscribe_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	list = emq_list_init();
-	if (!list) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		free(buffer);
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
 
-	EMQ_LIST_SET_FREE_METHOD(list, emq_queue_list_free_handler);
-
-	for (i = 0; i < header.bodylen;)
+	if (!client->noack)
 	{
-		queue = emq_queue_init();
-		if (!queue) {
-			emq_client_set_error(client, EMQ_ERROR_ALLOC);
-			emq_list_release(list);
-			free(buffer);
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
 			goto error;
 		}
 
-		memcpy(queue->name, buffer + i, 64);
-		i += 64;
-		memcpy(&queue->max_msg, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&queue->max_msg_size, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&queue->flags, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&queue->size, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&queue->declared_clients, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&queue->subscribed_clients, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
 
-		emq_list_add_value(list, queue);
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
 	}
 
-	free(buffer);
+	emq_queue_subscription_delete(client, name);
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return list;
+	return EMQ_STATUS_OK;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return NULL;
+	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_rename(emq_client *client, const char *from, const char *to)
+int emq_queue_purge(emq_client *client, const char *name)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_purge_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1233,7 +4280,7 @@ int emq_queue_rename(emq_client *client, const char *from, const char *to)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_RENAME, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_PURGE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1252,13 +4299,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_size(emq_client *client, const char *name)
+int emq_queue_delete(emq_client *client, const char *name)
 {
-	protocol_response_queue_size response;
+	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_size_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_queue_delete_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1268,60 +4319,52 @@ int emq_queue_size(emq_client *client, const char *name)
 		goto error;
 	}
 
-	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
+	if (!client->noack)
+	{
+		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			goto error;
+		}
 
-	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_QUEUE_SIZE,
-			sizeof(response.body)) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_DELETE, 0) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			goto error;
+		}
 
-	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&response.header));
-		goto error;
+		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&header));
+			goto error;
+		}
 	}
 
-	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
+	if (client->endpoint) {
+		emq_endpoint_forget(client, name);
 	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return response.body.size;
+	return EMQ_STATUS_OK;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return -1;
+	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_push(emq_client *client, const char *name, emq_msg *msg)
+int emq_route_create(emq_client *client, const char *name, uint32_t flags)
 {
 	protocol_response_header header;
-	struct iovec data[3];
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (msg->size < 1) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_queue_push_request(client, name, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+	if (emq_route_create_request(client, name, flags) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	data[0].iov_base = client->request;
-	data[0].iov_len = client->pos;
-	data[1].iov_base = &msg->expire;
-	data[1].iov_len = sizeof(msg->expire);
-	data[2].iov_base = msg->data;
-	data[2].iov_len = msg->size;
-
-	if (emq_client_writev(client, data, 3) == -1) {
+	if (emq_client_write(client, client->request, client->pos) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
@@ -1333,7 +4376,7 @@ int emq_queue_push(emq_client *client, const char *name, emq_msg *msg)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_PUSH, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_CREATE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1352,62 +4395,70 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-static emq_msg *emq_read_message(emq_client *client, size_t size)
+int emq_route_exist(emq_client *client, const char *name)
 {
-	emq_msg *msg;
+	protocol_response_route_exist response;
 
-	msg = (emq_msg*)malloc(sizeof(*msg));
-	if (!msg) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		return NULL;
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
 	}
 
-	msg->data = malloc(size);
-	msg->size = size;
-	msg->tag = 0;
-	msg->expire = 0;
-	msg->zero_copy = EMQ_ZEROCOPY_OFF;
+	if (emq_route_exist_request(client, name) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
 
-	if (!msg->data) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		free(msg);
-		return NULL;
+	if (emq_client_write(client, client->request, client->pos) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		goto error;
 	}
 
-	if (emq_client_read(client, (char*)msg->data, msg->size) == -1) {
+	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_READ);
-		free(msg->data);
-		free(msg);
-		return NULL;
+		goto error;
 	}
 
-	return msg;
-}
-
-static emq_msg *emq_read_message_tag(emq_client *client, size_t size)
-{
-	emq_msg *msg;
-	uint64_t tag;
+	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_ROUTE_EXIST,
+			sizeof(response.body)) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		goto error;
+	}
 
-	if (emq_client_read(client, (char*)&tag, sizeof(tag)) == -1) {
-		return NULL;
+	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&response.header));
+		goto error;
 	}
 
-	msg = emq_read_message(client, size - sizeof(tag));
+	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		goto error;
+	}
 
-	msg->tag = tag;
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return response.body.status;
 
-	return msg;
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return 0;
 }
 
-emq_msg *emq_queue_get(emq_client *client, const char *name)
+emq_list *emq_route_list(emq_client *client)
 {
 	protocol_response_header header;
-	emq_msg *msg;
+	emq_route *route;
+	emq_list *list;
+	char *buffer;
+	uint32_t i;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_get_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_route_list_request(client) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1422,36 +4473,82 @@ emq_msg *emq_queue_get(emq_client *client, const char *name)
 		goto error;
 	}
 
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_GET) == EMQ_STATUS_ERR) {
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_ROUTE_LIST) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 		goto error;
 	}
 
-	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&header));
-		goto error;
+	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, emq_get_error(&header));
+		goto error;
+	}
+
+	buffer = (char*)malloc(header.bodylen);
+	if (!buffer) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	if (emq_client_read(client, buffer, header.bodylen) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		free(buffer);
+		goto error;
+	}
+
+	list = emq_list_init();
+	if (!list) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		free(buffer);
+		goto error;
+	}
+
+	EMQ_LIST_SET_FREE_METHOD(list, emq_route_list_free_handler);
+
+	for (i = 0; i < header.bodylen;)
+	{
+		route = emq_route_init();
+		if (!route) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			emq_list_release(list);
+			free(buffer);
+			goto error;
+		}
+
+		memcpy(route->name, buffer + i, 64);
+		i += 64;
+		memcpy(&route->flags, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&route->keys, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+
+		emq_list_add_value(list, route);
 	}
 
-	if ((msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
-		goto error;
-	}
+	free(buffer);
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return msg;
+	return list;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
 	return NULL;
 }
 
-emq_msg *emq_queue_pop(emq_client *client, const char *name, emq_time timeout)
+emq_list *emq_route_keys(emq_client *client, const char *name)
 {
 	protocol_response_header header;
-	emq_msg *msg;
+	emq_route_key *route_key;
+	emq_list *list;
+	char *buffer;
+	uint32_t i;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_pop_request(client, name, timeout) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_route_keys_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1466,7 +4563,7 @@ emq_msg *emq_queue_pop(emq_client *client, const char *name, emq_time timeout)
 		goto error;
 	}
 
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_POP) == EMQ_STATUS_ERR) {
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_ROUTE_KEYS) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 		goto error;
 	}
@@ -1476,25 +4573,66 @@ emq_msg *emq_queue_pop(emq_client *client, const char *name, emq_time timeout)
 		goto error;
 	}
 
-	if ((msg = emq_read_message_tag(client, header.bodylen)) == NULL) {
+	buffer = (char*)malloc(header.bodylen);
+	if (!buffer) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
+	if (emq_client_read(client, buffer, header.bodylen) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		free(buffer);
+		goto error;
+	}
+
+	list = emq_list_init();
+	if (!list) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		free(buffer);
 		goto error;
 	}
 
+	EMQ_LIST_SET_FREE_METHOD(list, emq_route_key_list_free_handler);
+
+	for (i = 0; i < header.bodylen;)
+	{
+		route_key = emq_route_key_init();
+		if (!route_key) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			emq_list_release(list);
+			free(buffer);
+			goto error;
+		}
+
+		memcpy(route_key->key, buffer + i, 32);
+		i += 32;
+		memcpy(route_key->queue, buffer + i, 64);
+		i += 64;
+
+		emq_list_add_value(list, route_key);
+	}
+
+	free(buffer);
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return msg;
+	return list;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
 	return NULL;
 }
 
-int emq_queue_confirm(emq_client *client, const char *name, emq_tag tag)
+int emq_route_rename(emq_client *client, const char *from, const char *to)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_confirm_request(client, name, tag) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_route_rename_request(client, from, to) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1511,7 +4649,7 @@ int emq_queue_confirm(emq_client *client, const char *name, emq_tag tag)
 			goto error;
 		}
 
-		if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_QUEUE_CONFIRM) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_RENAME, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1530,19 +4668,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_subscribe(emq_client *client, const char *name, uint32_t flags, emq_msg_callback *callback)
+int emq_route_bind(emq_client *client, const char *name, const char *queue, const char *key)
 {
 	protocol_response_header header;
-	emq_queue_subscription *subscription;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (!callback) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_queue_subscribe_request(client, name, flags) == EMQ_STATUS_ERR) {
+	if (emq_route_bind_request(client, name, queue, key) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1559,7 +4695,7 @@ int emq_queue_subscribe(emq_client *client, const char *name, uint32_t flags, em
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_BIND, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1570,14 +4706,6 @@ int emq_queue_subscribe(emq_client *client, const char *name, uint32_t flags, em
 		}
 	}
 
-	subscription = emq_queue_subscription_create(name, callback);
-	if (!subscription) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		goto error;
-	}
-
-	emq_list_add_value(client->queue_subscriptions, subscription);
-
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -1586,16 +4714,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_unsubscribe(emq_client *client, const char *name)
+int emq_route_unbind(emq_client *client, const char *name, const char *queue, const char *key)
 {
 	protocol_response_header header;
-	emq_queue_subscription *subscription;
-	emq_list_iterator iter;
-	emq_list_node *node;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_unsubscribe_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_route_unbind_request(client, name, queue, key) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1612,7 +4741,7 @@ int emq_queue_unsubscribe(emq_client *client, const char *name)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_UNBIND, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1623,15 +4752,6 @@ int emq_queue_unsubscribe(emq_client *client, const char *name)
 		}
 	}
 
-	emq_list_rewind(client->queue_subscriptions, &iter);
-	while ((node = emq_list_next(&iter)) != NULL)
-	{
-		subscription = EMQ_LIST_VALUE(node);
-		if (!strcmp(subscription->name, name)) {
-			emq_list_delete_node(client->queue_subscriptions, node);
-		}
-	}
-
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -1640,18 +4760,44 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_purge(emq_client *client, const char *name)
+int emq_route_push(emq_client *client, const char *name, const char *key, emq_msg *msg)
 {
 	protocol_response_header header;
+	struct iovec data[2 + EMQ_MSG_IOV_MAX];
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_purge_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (msg->size < 1) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
+	if (emq_route_push_request(client, name, key, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (EMQ_PIPELINE_ACTIVE(client)) {
+		if (emq_pipeline_append(client, EMQ_PROTOCOL_CMD_ROUTE_PUSH, &msg->expire,
+				sizeof(msg->expire), msg) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	data[0].iov_base = client->request;
+	data[0].iov_len = client->pos;
+	data[1].iov_base = &msg->expire;
+	data[1].iov_len = sizeof(msg->expire);
+
+	if (emq_client_writev(client, data, 2 + emq_msg_iov(msg, data + 2)) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
@@ -1663,7 +4809,7 @@ int emq_queue_purge(emq_client *client, const char *name)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_PURGE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_PUSH, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1674,6 +4820,10 @@ int emq_queue_purge(emq_client *client, const char *name)
 		}
 	}
 
+	if (client->window && client->noack) {
+		emq_noack_sent(client, 1);
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -1682,13 +4832,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_queue_delete(emq_client *client, const char *name)
+int emq_route_delete(emq_client *client, const char *name)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_queue_delete_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_route_delete_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1705,7 +4859,7 @@ int emq_queue_delete(emq_client *client, const char *name)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_QUEUE_DELETE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_DELETE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1724,13 +4878,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_create(emq_client *client, const char *name, uint32_t flags)
+int emq_channel_create(emq_client *client, const char *name, uint32_t flags)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_create_request(client, name, flags) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_create_request(client, name, flags) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1747,7 +4905,7 @@ int emq_route_create(emq_client *client, const char *name, uint32_t flags)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_CREATE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_CREATE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -1766,13 +4924,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_exist(emq_client *client, const char *name)
+int emq_channel_exist(emq_client *client, const char *name)
 {
-	protocol_response_route_exist response;
+	protocol_response_channel_exist response;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_exist_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_exist_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1787,7 +4949,7 @@ int emq_route_exist(emq_client *client, const char *name)
 		goto error;
 	}
 
-	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_ROUTE_EXIST,
+	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_CHANNEL_EXIST,
 			sizeof(response.body)) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 		goto error;
@@ -1811,103 +4973,21 @@ error:
 	return 0;
 }
 
-emq_list *emq_route_list(emq_client *client)
-{
-	protocol_response_header header;
-	emq_route *route;
-	emq_list *list;
-	char *buffer;
-	uint32_t i;
-
-	EMQ_CLEAR_ERROR(client);
-
-	if (emq_route_list_request(client) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
-
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_ROUTE_LIST) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
-
-	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&header));
-		goto error;
-	}
-
-	buffer = (char*)malloc(header.bodylen);
-	if (!buffer) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		goto error;
-	}
-
-	if (emq_client_read(client, buffer, header.bodylen) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		free(buffer);
-		goto error;
-	}
-
-	list = emq_list_init();
-	if (!list) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		free(buffer);
-		goto error;
-	}
-
-	EMQ_LIST_SET_FREE_METHOD(list, emq_route_list_free_handler);
-
-	for (i = 0; i < header.bodylen;)
-	{
-		route = emq_route_init();
-		if (!route) {
-			emq_client_set_error(client, EMQ_ERROR_ALLOC);
-			emq_list_release(list);
-			free(buffer);
-			goto error;
-		}
-
-		memcpy(route->name, buffer + i, 64);
-		i += 64;
-		memcpy(&route->flags, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&route->keys, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-
-		emq_list_add_value(list, route);
-	}
-
-	free(buffer);
-
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return list;
-
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return NULL;
-}
-
-emq_list *emq_route_keys(emq_client *client, const char *name)
+emq_list *emq_channel_list(emq_client *client)
 {
 	protocol_response_header header;
-	emq_route_key *route_key;
+	emq_channel *channel;
 	emq_list *list;
 	char *buffer;
 	uint32_t i;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_keys_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_list_request(client) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -1922,7 +5002,7 @@ emq_list *emq_route_keys(emq_client *client, const char *name)
 		goto error;
 	}
 
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_ROUTE_KEYS) == EMQ_STATUS_ERR) {
+	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_CHANNEL_LIST) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 		goto error;
 	}
@@ -1951,24 +5031,28 @@ emq_list *emq_route_keys(emq_client *client, const char *name)
 		goto error;
 	}
 
-	EMQ_LIST_SET_FREE_METHOD(list, emq_route_key_list_free_handler);
+	EMQ_LIST_SET_FREE_METHOD(list, emq_channel_list_free_handler);
 
 	for (i = 0; i < header.bodylen;)
 	{
-		route_key = emq_route_key_init();
-		if (!route_key) {
+		channel = emq_channel_init();
+		if (!channel) {
 			emq_client_set_error(client, EMQ_ERROR_ALLOC);
 			emq_list_release(list);
 			free(buffer);
 			goto error;
 		}
 
-		memcpy(route_key->key, buffer + i, 32);
-		i += 32;
-		memcpy(route_key->queue, buffer + i, 64);
+		memcpy(channel->name, buffer + i, 64);
 		i += 64;
+		memcpy(&channel->flags, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&channel->topics, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
+		memcpy(&channel->patterns, buffer + i, sizeof(uint32_t));
+		i += sizeof(uint32_t);
 
-		emq_list_add_value(list, route_key);
+		emq_list_add_value(list, channel);
 	}
 
 	free(buffer);
@@ -1979,15 +5063,20 @@ emq_list *emq_route_keys(emq_client *client, const char *name)
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
 	return NULL;
+
 }
 
-int emq_route_rename(emq_client *client, const char *from, const char *to)
+int emq_channel_rename(emq_client *client, const char *from, const char *to)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_rename_request(client, from, to) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -2004,7 +5093,7 @@ int emq_route_rename(emq_client *client, const char *from, const char *to)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_RENAME, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_RENAME, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2023,18 +5112,41 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_bind(emq_client *client, const char *name, const char *queue, const char *key)
+int emq_channel_publish(emq_client *client, const char *name, const char *topic, emq_msg *msg)
 {
 	protocol_response_header header;
+	struct iovec data[1 + EMQ_MSG_IOV_MAX];
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_bind_request(client, name, queue, key) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (msg->size < 1) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
+	if (emq_channel_publish_request(client, name, topic, msg->size) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (EMQ_PIPELINE_ACTIVE(client)) {
+		if (emq_pipeline_append(client, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, NULL, 0, msg) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	data[0].iov_base = client->request;
+	data[0].iov_len = client->pos;
+
+	if (emq_client_writev(client, data, 1 + emq_msg_iov(msg, data + 1)) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
@@ -2046,7 +5158,7 @@ int emq_route_bind(emq_client *client, const char *name, const char *queue, cons
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_BIND, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2057,6 +5169,10 @@ int emq_route_bind(emq_client *client, const char *name, const char *queue, cons
 		}
 	}
 
+	if (client->window && client->noack) {
+		emq_noack_sent(client, 1);
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2065,13 +5181,22 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_unbind(emq_client *client, const char *name, const char *queue, const char *key)
+int emq_channel_subscribe(emq_client *client, const char *name, const char *topic, emq_msg_callback *callback)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_unbind_request(client, name, queue, key) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (!callback) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_channel_subscribe_request(client, name, topic) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -2088,7 +5213,7 @@ int emq_route_unbind(emq_client *client, const char *name, const char *queue, co
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_UNBIND, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2099,6 +5224,11 @@ int emq_route_unbind(emq_client *client, const char *name, const char *queue, co
 		}
 	}
 
+	if (emq_channel_subscription_add(client, name, topic, 0, callback) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2107,31 +5237,27 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_push(emq_client *client, const char *name, const char *key, emq_msg *msg)
+int emq_channel_psubscribe(emq_client *client, const char *name, const char *pattern, emq_msg_callback *callback)
 {
 	protocol_response_header header;
-	struct iovec data[3];
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (msg->size < 1) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_route_push_request(client, name, key, sizeof(msg->expire) + msg->size) == EMQ_STATUS_ERR) {
+	if (!callback) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	data[0].iov_base = client->request;
-	data[0].iov_len = client->pos;
-	data[1].iov_base = &msg->expire;
-	data[1].iov_len = sizeof(msg->expire);
-	data[2].iov_base = msg->data;
-	data[2].iov_len = msg->size;
+	if (emq_channel_psubscribe_request(client, name, pattern) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
 
-	if (emq_client_writev(client, data, 3) == -1) {
+	if (emq_client_write(client, client->request, client->pos) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
@@ -2143,7 +5269,7 @@ int emq_route_push(emq_client *client, const char *name, const char *key, emq_ms
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_PUSH, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2154,6 +5280,11 @@ int emq_route_push(emq_client *client, const char *name, const char *key, emq_ms
 		}
 	}
 
+	if (emq_channel_subscription_add(client, name, pattern, 1, callback) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error;
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2162,13 +5293,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_route_delete(emq_client *client, const char *name)
+int emq_channel_unsubscribe(emq_client *client, const char *name, const char *topic)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_route_delete_request(client, name) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_unsubscribe_request(client, name, topic) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -2185,7 +5320,7 @@ int emq_route_delete(emq_client *client, const char *name)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_ROUTE_DELETE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2196,6 +5331,8 @@ int emq_route_delete(emq_client *client, const char *name)
 		}
 	}
 
+	emq_channel_subscription_delete(client, name, topic, 0);
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2204,13 +5341,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_channel_create(emq_client *client, const char *name, uint32_t flags)
+int emq_channel_punsubscribe(emq_client *client, const char *name, const char *pattern)
 {
 	protocol_response_header header;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_channel_create_request(client, name, flags) == EMQ_STATUS_ERR) {
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (emq_channel_punsubscribe_request(client, name, pattern) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -2227,7 +5368,7 @@ int emq_channel_create(emq_client *client, const char *name, uint32_t flags)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_CREATE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2238,6 +5379,8 @@ int emq_channel_create(emq_client *client, const char *name, uint32_t flags)
 		}
 	}
 
+	emq_channel_subscription_delete(client, name, pattern, 1);
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2246,147 +5389,17 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_channel_exist(emq_client *client, const char *name)
-{
-	protocol_response_channel_exist response;
-
-	EMQ_CLEAR_ERROR(client);
-
-	if (emq_channel_exist_request(client, name) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (emq_client_read(client, (char*)&response.header, sizeof(response.header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
-
-	if (emq_check_response_header(&response.header, EMQ_PROTOCOL_CMD_CHANNEL_EXIST,
-			sizeof(response.body)) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
-
-	if (emq_check_status(&response.header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&response.header));
-		goto error;
-	}
-
-	if (emq_client_read(client, (char*)&response.body, sizeof(response.body)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
-
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return response.body.status;
-
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return 0;
-}
-
-emq_list *emq_channel_list(emq_client *client)
+int emq_channel_delete(emq_client *client, const char *name)
 {
 	protocol_response_header header;
-	emq_channel *channel;
-	emq_list *list;
-	char *buffer;
-	uint32_t i;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_channel_list_request(client) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
-
-	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		goto error;
-	}
-
-	if (emq_check_response_header_mini(&header, EMQ_PROTOCOL_CMD_CHANNEL_LIST) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-		goto error;
-	}
-
-	if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, emq_get_error(&header));
-		goto error;
-	}
-
-	buffer = (char*)malloc(header.bodylen);
-	if (!buffer) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		goto error;
-	}
-
-	if (emq_client_read(client, buffer, header.bodylen) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		free(buffer);
-		goto error;
-	}
-
-	list = emq_list_init();
-	if (!list) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		free(buffer);
-		goto error;
-	}
-
-	EMQ_LIST_SET_FREE_METHOD(list, emq_channel_list_free_handler);
-
-	for (i = 0; i < header.bodylen;)
-	{
-		channel = emq_channel_init();
-		if (!channel) {
-			emq_client_set_error(client, EMQ_ERROR_ALLOC);
-			emq_list_release(list);
-			free(buffer);
-			goto error;
-		}
-
-		memcpy(channel->name, buffer + i, 64);
-		i += 64;
-		memcpy(&channel->flags, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&channel->topics, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-		memcpy(&channel->patterns, buffer + i, sizeof(uint32_t));
-		i += sizeof(uint32_t);
-
-		emq_list_add_value(list, channel);
-	}
-
-	free(buffer);
-
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return list;
-
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return NULL;
-
-}
-
-int emq_channel_rename(emq_client *client, const char *from, const char *to)
-{
-	protocol_response_header header;
-
-	EMQ_CLEAR_ERROR(client);
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
 
-	if (emq_channel_rename_request(client, from, to) == EMQ_STATUS_ERR) {
+	if (emq_channel_delete_request(client, name) == EMQ_STATUS_ERR) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
@@ -2403,7 +5416,7 @@ int emq_channel_rename(emq_client *client, const char *from, const char *to)
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_RENAME, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_DELETE, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
@@ -2422,51 +5435,167 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_channel_publish(emq_client *client, const char *name, const char *topic, emq_msg *msg)
+static void emq_handle_encode(protocol_request_header *header, uint8_t cmd, uint32_t bodylen)
 {
-	protocol_response_header header;
-	struct iovec data[2];
+	header->magic = EMQ_PROTOCOL_REQ;
+	header->cmd = cmd;
+	header->noack = 0;
+	header->bodylen = bodylen;
+}
+
+emq_queue_handle *emq_queue_handle_create(const char *name)
+{
+	emq_queue_handle *handle;
+
+	if (strlenz(name) > sizeof(handle->request.body.name)) {
+		return NULL;
+	}
+
+	handle = (emq_queue_handle*)calloc(1, sizeof(*handle));
+	if (!handle) {
+		return NULL;
+	}
+
+	emq_handle_encode(&handle->request.header, EMQ_PROTOCOL_CMD_QUEUE_PUSH, sizeof(handle->request.body));
+	memcpy(handle->request.body.name, name, strlenz(name));
+
+	return handle;
+}
+
+emq_route_handle *emq_route_handle_create(const char *name, const char *key)
+{
+	emq_route_handle *handle;
+
+	if (strlenz(name) > sizeof(handle->request.body.name) || strlenz(key) > sizeof(handle->request.body.key)) {
+		return NULL;
+	}
+
+	handle = (emq_route_handle*)calloc(1, sizeof(*handle));
+	if (!handle) {
+		return NULL;
+	}
+
+	emq_handle_encode(&handle->request.header, EMQ_PROTOCOL_CMD_ROUTE_PUSH, sizeof(handle->request.body));
+	memcpy(handle->request.body.name, name, strlenz(name));
+	memcpy(handle->request.body.key, key, strlenz(key));
+
+	return handle;
+}
+
+emq_channel_handle *emq_channel_handle_create(const char *name, const char *topic)
+{
+	emq_channel_handle *handle;
+
+	if (strlenz(name) > sizeof(handle->request.body.name) || strlenz(topic) > sizeof(handle->request.body.topic)) {
+		return NULL;
+	}
+
+	handle = (emq_channel_handle*)calloc(1, sizeof(*handle));
+	if (!handle) {
+		return NULL;
+	}
+
+	emq_handle_encode(&handle->request.header, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, sizeof(handle->request.body));
+	memcpy(handle->request.body.name, name, strlenz(name));
+	memcpy(handle->request.body.topic, topic, strlenz(topic));
+
+	return handle;
+}
+
+void emq_queue_handle_release(emq_queue_handle *handle)
+{
+	free(handle);
+}
+
+void emq_route_handle_release(emq_route_handle *handle)
+{
+	free(handle);
+}
+
+void emq_channel_handle_release(emq_channel_handle *handle)
+{
+	free(handle);
+}
+
+/* The handle stays read-only: only a copy of its header is patched, so one handle
+   may be used by several clients at once */
+static int emq_handle_send(emq_client *client, const protocol_request_header *frame, size_t size,
+	int expire, emq_msg *msg)
+{
+	protocol_response_header response;
+	protocol_request_header header;
+	struct iovec data[3 + EMQ_MSG_IOV_MAX];
+	int iovcnt;
 
 	EMQ_CLEAR_ERROR(client);
 
-	if (msg->size < 1) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (emq_channel_publish_request(client, name, topic, msg->size) == EMQ_STATUS_ERR) {
+	if (!EMQ_MSG_SIZE_VALID(msg, frame->bodylen + (expire ? sizeof(msg->expire) : 0))) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	data[0].iov_base = client->request;
-	data[0].iov_len = client->pos;
-	data[1].iov_base = msg->data;
-	data[1].iov_len = msg->size;
+	header = *frame;
+	header.noack = client->noack;
+	header.bodylen = frame->bodylen + (expire ? sizeof(msg->expire) : 0) + msg->size;
+
+	if (EMQ_PIPELINE_ACTIVE(client)) {
+		memcpy(client->request, &header, sizeof(header));
+		memcpy(client->request + sizeof(header), frame + 1, size - sizeof(header));
+		client->pos = size;
+
+		if (emq_pipeline_append(client, header.cmd, (expire ? &msg->expire : NULL),
+				(expire ? sizeof(msg->expire) : 0), msg) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	data[0].iov_base = &header;
+	data[0].iov_len = sizeof(header);
+	data[1].iov_base = (void*)(frame + 1);
+	data[1].iov_len = size - sizeof(header);
+	iovcnt = 2;
+
+	if (expire) {
+		data[iovcnt].iov_base = &msg->expire;
+		data[iovcnt].iov_len = sizeof(msg->expire);
+		iovcnt++;
+	}
 
-	if (emq_client_writev(client, data, 2) == -1) {
+	if (emq_client_writev(client, data, iovcnt + emq_msg_iov(msg, data + iovcnt)) == -1) {
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
 		goto error;
 	}
 
 	if (!client->noack)
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		if (emq_client_read(client, (char*)&response, sizeof(response)) == -1) {
 			emq_client_set_error(client, EMQ_ERROR_READ);
 			goto error;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&response, header.cmd, 0) == EMQ_STATUS_ERR) {
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
 			goto error;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+		if (emq_check_status(&response, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, emq_get_error(&response));
 			goto error;
 		}
 	}
 
+	if (client->window && client->noack) {
+		emq_noack_sent(client, 1);
+	}
+
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2475,260 +5604,574 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-int emq_channel_subscribe(emq_client *client, const char *name, const char *topic, emq_msg_callback *callback)
+int emq_queue_push_handle(emq_client *client, emq_queue_handle *handle, emq_msg *msg)
 {
-	protocol_response_header header;
-	emq_channel_subscription *subscription;
+	return emq_handle_send(client, &handle->request.header, sizeof(handle->request), 1, msg);
+}
+
+int emq_route_push_handle(emq_client *client, emq_route_handle *handle, emq_msg *msg)
+{
+	return emq_handle_send(client, &handle->request.header, sizeof(handle->request), 1, msg);
+}
+
+int emq_channel_publish_handle(emq_client *client, emq_channel_handle *handle, emq_msg *msg)
+{
+	return emq_handle_send(client, &handle->request.header, sizeof(handle->request), 0, msg);
+}
 
+int emq_pipeline_begin(emq_client *client)
+{
 	EMQ_CLEAR_ERROR(client);
 
-	if (!callback) {
+	if (!client->pipeline) {
+		client->pipeline = emq_pipeline_create();
+		if (!client->pipeline) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			goto error;
+		}
+	}
+
+	if (client->pipeline->active) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_channel_subscribe_request(client, name, topic) == EMQ_STATUS_ERR) {
+	emq_pipeline_reset(client->pipeline);
+	client->pipeline->active = 1;
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_pipeline_exec(emq_client *client, int *statuses)
+{
+	protocol_response_header header;
+	emq_pipeline_command *command;
+	emq_pipeline *pipeline;
+	size_t noacked = 0;
+	int iovcnt = 0;
+	int failed = 0;
+	int code;
+	size_t i;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
+
+	if (!EMQ_PIPELINE_ACTIVE(client)) {
 		emq_client_set_error(client, EMQ_ERROR_DATA);
 		goto error;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
+	pipeline = client->pipeline;
+
+	if (!pipeline->count) {
+		emq_pipeline_reset(pipeline);
+		EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+		return EMQ_STATUS_OK;
+	}
+
+	for (i = 0; i < pipeline->count; i++)
+	{
+		command = &pipeline->commands[i];
+		iovcnt += 1 + (command->msg ? (command->msg->iovcnt ? command->msg->iovcnt : 1) : 0);
+	}
+
+	if (emq_pipeline_check_iov(pipeline, iovcnt) == EMQ_STATUS_ERR) {
+		emq_pipeline_set_statuses(statuses, 0, pipeline->count, EMQ_ERROR_ALLOC);
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		goto error_reset;
+	}
+
+	iovcnt = 0;
+
+	for (i = 0; i < pipeline->count; i++)
+	{
+		command = &pipeline->commands[i];
+
+		pipeline->iov[iovcnt].iov_base = pipeline->buffer + command->offset;
+		pipeline->iov[iovcnt].iov_len = command->length;
+		iovcnt++;
+
+		if (command->msg) {
+			iovcnt += emq_msg_iov(command->msg, pipeline->iov + iovcnt);
+		}
+	}
+
+	if (emq_client_writev(client, pipeline->iov, iovcnt) == -1) {
+		emq_pipeline_set_statuses(statuses, 0, pipeline->count, EMQ_ERROR_WRITE);
 		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
+		goto error_reset;
 	}
 
-	if (!client->noack)
+	for (i = 0; i < pipeline->count; i++)
 	{
+		command = &pipeline->commands[i];
+
+		if (command->noack) {
+			if (statuses) {
+				statuses[i] = EMQ_ERROR_NONE;
+			}
+			noacked++;
+			continue;
+		}
+
 		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+			emq_pipeline_set_statuses(statuses, i, pipeline->count, EMQ_ERROR_READ);
 			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+			goto error_reset;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE, 0) == EMQ_STATUS_ERR) {
+		if (emq_check_response_header(&header, command->cmd, 0) == EMQ_STATUS_ERR) {
+			emq_pipeline_set_statuses(statuses, i, pipeline->count, EMQ_ERROR_RESPONSE);
 			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+			goto error_reset;
 		}
 
 		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
+			code = emq_get_error(&header);
+			if (code == EMQ_ERROR_NONE) {
+				code = EMQ_ERROR_RESPONSE;
+			}
+
+			if (!failed++) {
+				emq_client_set_error(client, code);
+			}
+
+			if (statuses) {
+				statuses[i] = code;
+			}
+		} else if (statuses) {
+			statuses[i] = EMQ_ERROR_NONE;
 		}
 	}
 
-	subscription = emq_channel_subscription_create(name, topic, callback);
-	if (!subscription) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+	emq_pipeline_reset(pipeline);
+
+	if (failed) {
 		goto error;
 	}
 
-	emq_list_add_value(client->channel_subscriptions, subscription);
+	if (client->window && noacked) {
+		emq_noack_sent(client, noacked);
+	}
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
+error_reset:
+	emq_pipeline_reset(pipeline);
+
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
 	return EMQ_STATUS_ERR;
 }
 
-int emq_channel_psubscribe(emq_client *client, const char *name, const char *pattern, emq_msg_callback *callback)
+void emq_pipeline_discard(emq_client *client)
 {
-	protocol_response_header header;
-	emq_channel_subscription *subscription;
+	if (client->pipeline) {
+		emq_pipeline_reset(client->pipeline);
+	}
+}
+
+size_t emq_pipeline_length(emq_client *client)
+{
+	return client->pipeline ? client->pipeline->count : 0;
+}
+
+void emq_noack_enable(emq_client *client)
+{
+	client->noack = 1;
+}
+
+void emq_noack_disable(emq_client *client)
+{
+	client->noack = 0;
+
+	free(client->window);
+	client->window = NULL;
+}
 
+int emq_noack_window(emq_client *client, size_t count, uint32_t interval)
+{
 	EMQ_CLEAR_ERROR(client);
 
-	if (!callback) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	if (!client->window) {
+		client->window = (emq_window*)calloc(1, sizeof(emq_window));
+		if (!client->window) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+			return EMQ_STATUS_ERR;
+		}
 	}
 
-	if (emq_channel_psubscribe_request(client, name, pattern) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	client->window->count = count;
+	client->window->interval = interval;
+	client->window->last = emq_mstime();
+	client->noack = 1;
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+/* An acked ping is answered after every earlier frame is processed */
+int emq_noack_sync(emq_client *client)
+{
+	emq_window *window = client->window;
+	int noack = client->noack;
+	int status;
+
+	client->noack = 0;
+	status = emq_ping(client);
+	client->noack = noack;
+
+	if (!window) {
+		return status;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
+	window->stats.barriers++;
+	window->last = emq_mstime();
+
+	if (status == EMQ_STATUS_OK) {
+		window->stats.confirmed = window->stats.sent;
+		window->pending = 0;
+	} else {
+		window->stats.failed++;
 	}
 
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+	return status;
+}
+
+void emq_noack_stat(emq_client *client, emq_noack_stats *stats)
+{
+	if (client->window) {
+		*stats = client->window->stats;
+	} else {
+		memset(stats, 0, sizeof(*stats));
+	}
+}
+
+/* The frames are already written, a failed barrier is only counted in the statistics */
+static void emq_noack_sent(emq_client *client, size_t count)
+{
+	emq_window *window = client->window;
+
+	window->stats.sent += count;
+	window->pending += count;
+
+	if ((window->count && window->pending >= window->count) ||
+		(window->interval && emq_mstime() - window->last >= window->interval)) {
+		if (emq_noack_sync(client) == EMQ_STATUS_ERR) {
+			EMQ_CLEAR_ERROR(client);
 		}
+	}
+}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+static int emq_event_deliver(emq_client *client, emq_inbox *inbox, emq_batcher *batcher,
+	emq_msg_callback *callback, int type, const char *name, const char *topic, const char *pattern, emq_msg *msg)
+{
+	if (batcher && msg) {
+		return emq_batcher_push(batcher, topic, msg);
+	}
+
+	if (inbox) {
+		emq_inbox_push(inbox, callback, type, topic, pattern, msg);
+		return 0;
+	}
+
+	if (client->dispatch) {
+		if (emq_dispatch_flush(client) == EMQ_STATUS_ERR) {
+			emq_client_set_error(client, EMQ_ERROR_WRITE);
+			if (msg) {
+				emq_msg_release(msg);
+			}
+			return -1;
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
+		emq_dispatcher_submit(client, callback, type, name, topic, pattern, msg);
+		return 0;
+	}
+
+	return callback(client, type, name, topic, pattern, msg);
+}
+
+int emq_queue_deliver(emq_client *client, emq_queue_subscription *subscription, emq_msg *msg)
+{
+	if (emq_event_deliver(client, subscription->inbox, subscription->batcher, subscription->callback,
+		EMQ_CALLBACK_QUEUE, subscription->name, NULL, NULL, msg) &&
+		EMQ_DICT_LENGTH(client->queue_subscriptions) == 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static int emq_queue_process(emq_client *client, protocol_event_header *header)
+{
+	emq_queue_subscription *subscription;
+	protocol_event_queue event;
+	emq_msg *msg = NULL;
+
+	if (header->bodylen < sizeof(event)) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return -1;
+	}
+
+	if (emq_client_read(client, (char*)&event, sizeof(event)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return -1;
+	}
+
+	if ((subscription = emq_queue_subscription_find(client, event.name)) == NULL) {
+		return -1;
+	}
+
+	if (header->type == EMQ_PROTOCOL_EVENT_MESSAGE) {
+		if ((msg = emq_read_message(client, header->bodylen - sizeof(event))) == NULL) {
+			return -1;
 		}
 	}
 
-	subscription = emq_channel_subscription_create(name, pattern, callback);
+	if (!msg && subscription->drain) {
+		emq_drain_mark(subscription->drain);
+		return 0;
+	}
+
+	return emq_queue_deliver(client, subscription, msg);
+}
+
+int emq_channel_process(emq_client *client, protocol_event_header *header, int extended)
+{
+	emq_channel_subscription *subscription;
+	protocol_event_channel event;
+	emq_msg *msg = NULL;
+	size_t size;
+
+	size = extended ? sizeof(event) : sizeof(event) - sizeof(event.pattern);
+
+	if (header->bodylen < size) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return -1;
+	}
+
+	if (emq_client_read(client, (char*)&event, size) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return -1;
+	}
+
+	subscription = emq_channel_subscription_find(client, event.name, event.topic,
+		(extended ? event.pattern : NULL));
+
 	if (!subscription) {
-		emq_client_set_error(client, EMQ_ERROR_ALLOC);
-		goto error;
+		if (emq_client_skip(client, header->bodylen - size) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			return -1;
+		}
+
+		return 0;
 	}
 
-	emq_list_add_value(client->channel_subscriptions, subscription);
+	if ((msg = emq_read_message(client, header->bodylen - size)) == NULL) {
+		return -1;
+	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	if (emq_event_deliver(client, subscription->inbox, subscription->batcher, subscription->callback,
+		EMQ_CALLBACK_CHANNEL,
+		subscription->name, event.topic, (extended ? event.pattern : NULL), msg) &&
+		EMQ_DICT_LENGTH(client->queue_subscriptions) == 0) {
+		return 1;
+	}
 
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	return 0;
 }
 
-int emq_channel_unsubscribe(emq_client *client, const char *name, const char *topic)
+int emq_event_dispatch(emq_client *client, protocol_event_header *header, const char *body)
 {
-	protocol_response_header header;
-	emq_channel_subscription *subscription;
-	emq_list_iterator iter;
-	emq_list_node *node;
+	emq_queue_subscription *queue_subscription;
+	emq_channel_subscription *channel_subscription;
+	protocol_event_channel event;
+	emq_msg *msg = NULL;
+	size_t size;
+	int extended;
 
-	EMQ_CLEAR_ERROR(client);
+	memset(&event, 0, sizeof(event));
 
-	if (emq_channel_unsubscribe_request(client, name, topic) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
+	if (header->cmd == EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE)
+	{
+		size = sizeof(protocol_event_queue);
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
-	}
+		if (header->bodylen < size) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			return -1;
+		}
 
-	if (!client->noack)
-	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+		memcpy(event.name, body, size);
+
+		if ((queue_subscription = emq_queue_subscription_find(client, event.name)) == NULL) {
+			return 0;
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+		if (header->type == EMQ_PROTOCOL_EVENT_MESSAGE) {
+			msg = emq_msg_pool_get(client->msg_pool, (void*)(body + size), header->bodylen - size);
+			if (!msg) {
+				emq_client_set_error(client, EMQ_ERROR_ALLOC);
+				return -1;
+			}
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
+		if (!msg && queue_subscription->drain) {
+			emq_drain_mark(queue_subscription->drain);
+			return 0;
 		}
+
+		return emq_queue_deliver(client, queue_subscription, msg);
 	}
 
-	emq_list_rewind(client->channel_subscriptions, &iter);
-	while ((node = emq_list_next(&iter)) != NULL)
+	if (header->cmd == EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE ||
+		header->cmd == EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE)
 	{
-		subscription = EMQ_LIST_VALUE(node);
-		if (!strcmp(subscription->name, name)) {
-			emq_list_delete_node(client->channel_subscriptions, node);
+		extended = header->cmd == EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE;
+		size = extended ? sizeof(event) : sizeof(event) - sizeof(event.pattern);
+
+		if (header->bodylen < size) {
+			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+			return -1;
 		}
-	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+		memcpy(&event, body, size);
 
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+		channel_subscription = emq_channel_subscription_find(client, event.name, event.topic,
+			(extended ? event.pattern : NULL));
+
+		if (!channel_subscription) {
+			return 0;
+		}
+
+		msg = emq_msg_pool_get(client->msg_pool, (void*)(body + size), header->bodylen - size);
+		if (!msg) {
+			emq_client_set_error(client, EMQ_ERROR_ALLOC);
+			return -1;
+		}
+
+		if (emq_event_deliver(client, channel_subscription->inbox, channel_subscription->batcher,
+			channel_subscription->callback,
+			EMQ_CALLBACK_CHANNEL, channel_subscription->name, event.topic, (extended ? event.pattern : NULL),
+			msg) && EMQ_DICT_LENGTH(client->queue_subscriptions) == 0) {
+			return 1;
+		}
+
+		return 0;
+	}
+
+	emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+	return -1;
 }
 
-int emq_channel_punsubscribe(emq_client *client, const char *name, const char *pattern)
+static int emq_process_event(emq_client *client)
 {
-	protocol_response_header header;
-	emq_channel_subscription *subscription;
-	emq_list_iterator iter;
-	emq_list_node *node;
-
-	EMQ_CLEAR_ERROR(client);
+	protocol_event_header header;
 
-	if (emq_channel_punsubscribe_request(client, name, pattern) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
+	if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
+		emq_client_set_error(client, EMQ_ERROR_READ);
+		return -1;
 	}
 
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
-		goto error;
+	if (emq_check_event_header(&header, EMQ_PROTOCOL_EVENT_NOTIFY, EMQ_PROTOCOL_EVENT_MESSAGE) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+		return -1;
 	}
 
-	if (!client->noack)
+	switch (header.cmd)
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+		case EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE:
+			return emq_queue_process(client, &header);
+		case EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE:
+			return emq_channel_process(client, &header, 0);
+		case EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE:
+			return emq_channel_process(client, &header, 1);
+	}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_UNSUBSCRIBE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
-		}
+	emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+	return -1;
+}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
-			goto error;
-		}
+#define EMQ_PROCESS_SUBSCRIBED(client) \
+	(EMQ_DICT_LENGTH((client)->queue_subscriptions) || EMQ_DICT_LENGTH((client)->channel_subscriptions))
+
+#define EMQ_PROCESS_DEFERRED(client) ((client)->drains || (client)->batches || (client)->dispatch)
+
+/* Runs the work deferred until no more data is buffered: drains of the notified queues
+   and pending batches. Returns 1 if the processing should stop, -1 on error */
+static int emq_process_deferred(emq_client *client)
+{
+	int stop = 0;
+
+	if (client->dispatch && emq_dispatch_flush(client) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_WRITE);
+		return -1;
 	}
 
-	emq_list_rewind(client->channel_subscriptions, &iter);
-	while ((node = emq_list_next(&iter)) != NULL)
-	{
-		subscription = EMQ_LIST_VALUE(node);
-		if (!strcmp(subscription->name, name)) {
-			emq_list_delete_node(client->channel_subscriptions, node);
+	if (client->drains) {
+		switch (emq_drain_flush(client))
+		{
+			case 0: break;
+			case 1: stop = 1; break;
+			default: return -1;
 		}
 	}
 
-	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	if (client->batches && emq_batch_flush(client)) {
+		stop = 1;
+	}
 
-error:
-	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
-	return EMQ_STATUS_ERR;
+	return stop;
 }
 
-int emq_channel_delete(emq_client *client, const char *name)
+int emq_process(emq_client *client)
 {
-	protocol_response_header header;
-
 	EMQ_CLEAR_ERROR(client);
 
-	if (emq_channel_delete_request(client, name) == EMQ_STATUS_ERR) {
-		emq_client_set_error(client, EMQ_ERROR_DATA);
-		goto error;
-	}
-
-	if (emq_client_write(client, client->request, client->pos) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_WRITE);
+	if (EMQ_PREFETCH_DRAIN(client)) {
 		goto error;
 	}
 
-	if (!client->noack)
+	while (EMQ_PROCESS_SUBSCRIBED(client))
 	{
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
+		if (EMQ_PROCESS_DEFERRED(client) && emq_client_wait(client, 0) == 0) {
+			switch (emq_process_deferred(client))
+			{
+				case 0: break;
+				case 1: goto done;
+				default: goto recover;
+			}
 		}
 
-		if (emq_check_response_header(&header, EMQ_PROTOCOL_CMD_CHANNEL_DELETE, 0) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_RESPONSE);
-			goto error;
+		if (client->inboxes) {
+			emq_inbox_wait(client);
 		}
 
-		if (emq_check_status(&header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, emq_get_error(&header));
+		switch (emq_process_event(client))
+		{
+			case 0: continue;
+			case 1: break;
+			default: goto recover;
+		}
+
+		break;
+
+recover:
+		if (emq_process_recover(client) == EMQ_STATUS_ERR) {
 			goto error;
 		}
 	}
 
+done:
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
 	return EMQ_STATUS_OK;
 
@@ -2737,170 +6180,162 @@ error:
 	return EMQ_STATUS_ERR;
 }
 
-void emq_noack_enable(emq_client *client)
+/*
+ * Buffers one whole frame, reading only what poll reports, so a frame split across packets
+ * does not block past the timeout. Returns 1 if a frame is buffered, 0 on timeout, -1 on error.
+ */
+static int emq_process_wait(emq_client *client, int timeout)
 {
-	client->noack = 1;
-}
+	protocol_event_header header;
+	long long deadline = emq_mstime() + (timeout > 0 ? timeout : 0), now;
+	size_t available, need;
+	int status;
 
-void emq_noack_disable(emq_client *client)
-{
-	client->noack = 0;
-}
+	for (;;)
+	{
+		available = client->input_len - client->input_pos;
+		need = sizeof(header);
 
-static int emq_queue_process(emq_client *client, protocol_event_header *header)
-{
-	emq_queue_subscription *subscription;
-	emq_list_iterator iter;
-	emq_list_node *node;
-	emq_msg *msg = NULL;
-	char name[64];
-	int found = 0;
+		if (available >= sizeof(header)) {
+			memcpy(&header, client->input + client->input_pos, sizeof(header));
 
-	if (emq_client_read(client, name, sizeof(name)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		return -1;
-	}
+			if (header.bodylen > EMQ_MAX_REQUEST_SIZE) {
+				emq_client_set_error(client, EMQ_ERROR_RESPONSE);
+				return -1;
+			}
 
-	emq_list_rewind(client->queue_subscriptions, &iter);
-	while ((node = emq_list_next(&iter)) != NULL)
-	{
-		subscription = EMQ_LIST_VALUE(node);
-		if (!strcmp(subscription->name, name)) {
-			found = 1;
-			break;
+			need += header.bodylen;
 		}
-	}
 
-	if (!found) {
-		return -1;
-	}
+		if (available >= need) {
+			return 1;
+		}
 
-	if (header->type == EMQ_PROTOCOL_EVENT_MESSAGE) {
-		if ((msg = emq_read_message(client, header->bodylen - 64)) == NULL) {
-			return -1;
+		now = emq_mstime();
+		status = emq_client_poll(client, timeout < 0 ? -1 : (int)(deadline > now ? deadline - now : 0));
+
+		if (status == 0) {
+			return 0;
 		}
-	}
 
-	if (subscription->callback(client, EMQ_CALLBACK_QUEUE, subscription->name, NULL, NULL, msg) &&
-		client->queue_subscriptions->length == 0) {
-		return 1;
+		if (status == -1 || emq_client_fill(client, need) == -1) {
+			emq_client_set_error(client, EMQ_ERROR_READ);
+			return -1;
+		}
 	}
-
-	return 0;
 }
 
-int emq_channel_process(emq_client *client, protocol_event_header *header, int extended)
+static int emq_process_available(emq_client *client, int count, int timeout)
 {
-	emq_channel_subscription *subscription;
-	emq_list_iterator iter;
-	emq_list_node *node;
-	emq_msg *msg = NULL;
-	char name[64];
-	char topic[32];
-	char pattern[32];
-	int found = 0;
+	int processed = 0, status;
 
-	if (emq_client_read(client, name, sizeof(name)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		return -1;
-	}
+	while (EMQ_PROCESS_SUBSCRIBED(client) && (count <= 0 || processed < count))
+	{
+		if (client->inboxes && emq_inbox_paused(client)) {
+			break;
+		}
 
-	if (emq_client_read(client, topic, sizeof(topic)) == -1) {
-		emq_client_set_error(client, EMQ_ERROR_READ);
-		return -1;
-	}
+		if (EMQ_PROCESS_DEFERRED(client) && emq_client_wait(client, 0) == 0) {
+			status = emq_process_deferred(client);
+			if (status == -1) {
+				return -1;
+			}
 
-	if (extended)
-	{
-		if (emq_client_read(client, pattern, sizeof(pattern)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			return -1;
+			if (status == 1) {
+				break;
+			}
+
+			if (emq_client_wait(client, 0) == 1) {
+				continue;
+			}
 		}
-	}
 
-	emq_list_rewind(client->channel_subscriptions, &iter);
-	while ((node = emq_list_next(&iter)) != NULL)
-	{
-		subscription = EMQ_LIST_VALUE(node);
-		if (!strcmp(subscription->name, name)) {
-			found = 1;
+		status = emq_process_wait(client, timeout);
+
+		if (status == -1) {
+			if (emq_process_recover(client) == EMQ_STATUS_ERR) {
+				return -1;
+			}
+			continue;
+		}
+
+		if (status == 0) {
+			break;
+		}
+
+		status = emq_process_event(client);
+		if (status == -1) {
+			if (emq_process_recover(client) == EMQ_STATUS_ERR) {
+				return -1;
+			}
+			continue;
+		}
+
+		processed++;
+
+		if (status == 1) {
 			break;
 		}
+
+		timeout = 0;
 	}
 
-	if (!found) {
+	if (EMQ_PROCESS_DEFERRED(client) && emq_process_deferred(client) == -1) {
 		return -1;
 	}
 
-	if ((msg = emq_read_message(client, header->bodylen - (extended ? 128 : 96))) == NULL) {
-		return -1;
+	return processed;
+}
+
+int emq_process_once(emq_client *client, int count)
+{
+	int processed;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
 	}
 
-	if (subscription->callback(client, EMQ_CALLBACK_CHANNEL, subscription->name, topic,
-		(extended ? pattern : NULL), msg) && client->queue_subscriptions->length == 0) {
-		return 1;
+	if ((processed = emq_process_available(client, count, 0)) == -1) {
+		goto error;
 	}
 
-	return 0;
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return processed;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
 }
 
-int emq_process(emq_client *client)
+int emq_process_timeout(emq_client *client, int timeout)
 {
-	protocol_event_header header;
-	int status = 0;
+	int processed = 0, status;
+	long long deadline, now;
 
 	EMQ_CLEAR_ERROR(client);
 
-	for (;;)
-	{
-		if (!EMQ_LIST_LENGTH(client->queue_subscriptions) &&
-			!EMQ_LIST_LENGTH(client->channel_subscriptions))
-			break;
+	if (EMQ_PREFETCH_DRAIN(client)) {
+		goto error;
+	}
 
-		if (emq_client_read(client, (char*)&header, sizeof(header)) == -1) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+	deadline = emq_mstime() + (timeout > 0 ? timeout : 0);
 
-		if (emq_check_event_header(&header, EMQ_PROTOCOL_EVENT_NOTIFY, EMQ_PROTOCOL_EVENT_MESSAGE) == EMQ_STATUS_ERR) {
-			emq_client_set_error(client, EMQ_ERROR_READ);
-			goto error;
-		}
+	do {
+		now = emq_mstime();
 
-		if (header.cmd != EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE &&
-			header.cmd != EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE &&
-			header.cmd != EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE)
-		{
-			emq_client_set_error(client, EMQ_ERROR_READ);
+		status = emq_process_available(client, 0, (int)(deadline > now ? deadline - now : 0));
+		if (status == -1) {
 			goto error;
 		}
 
-		switch (header.cmd)
-		{
-			case EMQ_PROTOCOL_CMD_QUEUE_SUBSCRIBE:
-				status = emq_queue_process(client, &header);
-				break;
-			case EMQ_PROTOCOL_CMD_CHANNEL_SUBSCRIBE:
-				status = emq_channel_process(client, &header, 0);
-				break;
-			case EMQ_PROTOCOL_CMD_CHANNEL_PSUBSCRIBE:
-				status = emq_channel_process(client, &header, 1);
-				break;
-		}
-
-		switch (status)
-		{
-			case 0: break;
-			case 1: goto stop;
-			case -1: goto error;
-		}
-
-		continue;
-		stop: break;
-	}
+		processed += status;
+	} while (status == 0 && EMQ_PROCESS_SUBSCRIBED(client) && emq_mstime() < deadline &&
+		!(client->inboxes && emq_inbox_paused(client)));
 
 	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
-	return EMQ_STATUS_OK;
+	return processed;
 
 error:
 	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
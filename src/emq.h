@@ -30,9 +30,10 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
-#define EMQ_VERSION_MAJOR 1
-#define EMQ_VERSION_MINOR 3 /* 0..9 */
+#define EMQ_VERSION_MAJOR 2
+#define EMQ_VERSION_MINOR 0 /* 0..9 */
 
 #define EMQ_VERSION(major, minor) (major * 10 + minor)
 
@@ -43,6 +44,12 @@
 
 #define EMQ_ERROR_BUF_SIZE 256
 #define EMQ_DEFAULT_REQUEST_SIZE 4096
+#define EMQ_DEFAULT_PIPELINE_SIZE 64
+#define EMQ_DEFAULT_INPUT_SIZE 16384
+#define EMQ_DEFAULT_CONFIRM_COUNT 64
+#define EMQ_DEFAULT_CONFIRM_DELAY 100
+#define EMQ_DEFAULT_MSG_POOL_CACHED 1024
+#define EMQ_DEFAULT_BATCH_COUNT 64
 #define EMQ_MAX_REQUEST_SIZE 2147483647
 
 #define EMQ_GET_STATUS(client) (client->status)
@@ -136,14 +143,26 @@
 #define EMQ_ERROR_NOT_DECLARED 10
 #define EMQ_ERROR_NOT_FOUND 11
 #define EMQ_ERROR_NO_DATA 12
+#define EMQ_ERROR_TRUNCATED 13
 
 #define EMQ_GET_ERROR(client) (client->error)
 #define EMQ_ISSET_ERROR(client) (client->error[0] != '\0')
-#define EMQ_CLEAR_ERROR(client) (client->error[0] = '\0')
+#define EMQ_CLEAR_ERROR(client) (client->error[0] = '\0', client->error_code = EMQ_ERROR_NONE)
 
 #define EMQ_ZEROCOPY_ON 1
 #define EMQ_ZEROCOPY_OFF 0
 
+#define EMQ_MSG_IOV_MAX 16
+
+#define EMQ_MSG_POOL_NONE 0
+#define EMQ_MSG_POOL_SINGLE_BLOCK 1
+
+#define EMQ_MSG_POOL_MIN_SIZE 64
+#define EMQ_MSG_POOL_CLASSES 11
+
+#define EMQ_INBOX_BLOCK 0
+#define EMQ_INBOX_DROP_OLDEST 1
+
 typedef struct emq_list_node {
 	struct emq_list_node *prev;
 	struct emq_list_node *next;
@@ -161,16 +180,57 @@ typedef struct emq_list {
 	void (*free)(void *value);
 } emq_list;
 
+typedef struct emq_dict_entry {
+	struct emq_dict_entry *next;
+	unsigned int hash;
+	const char *key;
+	void *value;
+} emq_dict_entry;
+
+typedef struct emq_dict {
+	emq_dict_entry **table;
+	size_t size;
+	size_t mask;
+	size_t count;
+	void (*free)(void *value);
+} emq_dict;
+
+struct emq_pipeline;
+struct emq_prefetch;
+struct emq_confirm;
+struct emq_msg_pool;
+struct emq_dispatch_client;
+struct emq_inboxes;
+struct emq_batcher;
+struct emq_drain;
+struct emq_window;
+struct emq_endpoint;
+
 typedef struct emq_client {
 	int status;
 	char error[EMQ_ERROR_BUF_SIZE];
+	int error_code;
 	char *request;
 	size_t size;
 	size_t pos;
+	char *input;
+	size_t input_size;
+	size_t input_pos;
+	size_t input_len;
 	int noack;
 	int fd;
-	emq_list *queue_subscriptions;
-	emq_list *channel_subscriptions;
+	emq_dict *queue_subscriptions;
+	emq_dict *channel_subscriptions;
+	struct emq_pipeline *pipeline;
+	struct emq_prefetch *prefetch;
+	struct emq_confirm *confirm;
+	struct emq_msg_pool *msg_pool;
+	struct emq_dispatch_client *dispatch;
+	struct emq_inboxes *inboxes;
+	struct emq_batcher *batches;
+	struct emq_drain *drains;
+	struct emq_window *window;
+	struct emq_endpoint *endpoint;
 } emq_client;
 
 typedef uint64_t emq_perm;
@@ -217,11 +277,73 @@ typedef struct emq_msg {
 	emq_tag tag;
 	emq_time expire;
 	int zero_copy;
+	struct emq_msg_pool *pool;
+	int refcount;
+	struct emq_msg *shared;
+	struct iovec *iov;
+	int iovcnt;
 } emq_msg;
 
+typedef struct emq_msg_pool emq_msg_pool;
+
+typedef struct emq_noack_stats {
+	uint64_t sent;
+	uint64_t confirmed;
+	uint64_t barriers;
+	uint64_t failed;
+} emq_noack_stats;
+
+typedef struct emq_queue_handle emq_queue_handle;
+typedef struct emq_route_handle emq_route_handle;
+typedef struct emq_channel_handle emq_channel_handle;
+
+typedef struct emq_msg_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	float hit_rate;
+	size_t used;
+	size_t cached;
+	size_t high_water;
+	struct {
+		size_t size;
+		size_t used;
+		size_t cached;
+		size_t high_water;
+	} classes[EMQ_MSG_POOL_CLASSES];
+} emq_msg_pool_stats;
+
+typedef struct emq_inbox_limits {
+	size_t max_messages;
+	size_t max_bytes;
+	size_t low_messages;
+	size_t low_bytes;
+	int policy;
+} emq_inbox_limits;
+
+typedef struct emq_inbox_stats {
+	size_t messages;
+	size_t bytes;
+	uint64_t dropped;
+	int paused;
+} emq_inbox_stats;
+
 typedef int emq_msg_callback(emq_client *client, int type, const char *name,
 	const char *topic, const char *pattern, emq_msg *msg);
 
+typedef struct emq_batch {
+	int type;
+	const char *name;
+	const char *pattern;
+	const char **topics;
+	emq_msg **msgs;
+	size_t count;
+	size_t bytes;
+} emq_batch;
+
+typedef int emq_batch_callback(emq_client *client, emq_batch *batch);
+
+typedef void emq_confirm_callback(emq_client *client, const char *name, emq_tag tag, int error);
+
 #pragma pack(push, 1)
 
 typedef struct emq_status {
@@ -248,16 +370,28 @@ typedef struct emq_status {
 #pragma pack(pop)
 
 emq_msg *emq_msg_create(void *data, size_t size, int zero_copy);
+emq_msg *emq_msg_createv(const struct iovec *iov, int iovcnt);
 emq_msg *emq_msg_copy(emq_msg *msg);
+emq_msg *emq_msg_share(emq_msg *msg);
+emq_msg *emq_msg_ref(emq_msg *msg);
+void emq_msg_unref(emq_msg *msg);
 void emq_msg_expire(emq_msg *msg, emq_time time);
 void *emq_msg_data(emq_msg *msg);
 size_t emq_msg_size(emq_msg *msg);
 emq_tag emq_msg_tag(emq_msg *msg);
 void emq_msg_release(emq_msg *msg);
 
+emq_msg_pool *emq_msg_pool_create(uint32_t flags, size_t max_cached);
+emq_msg *emq_msg_pool_get(emq_msg_pool *pool, void *data, size_t size);
+void emq_msg_pool_stat(emq_msg_pool *pool, emq_msg_pool_stats *stats);
+int emq_msg_pool_attach(emq_client *client, emq_msg_pool *pool);
+void emq_msg_pool_release(emq_msg_pool *pool);
+
 emq_client *emq_tcp_connect(const char *addr, int port);
 emq_client *emq_unix_connect(const char *path);
 void emq_disconnect(emq_client *client);
+int emq_reconnect(emq_client *client);
+int emq_auto_reconnect(emq_client *client, int retries, uint32_t min_delay, uint32_t max_delay);
 
 int emq_auth(emq_client *client, const char *name, const char *password);
 int emq_ping(emq_client *client);
@@ -278,10 +412,29 @@ emq_list *emq_queue_list(emq_client *client);
 int emq_queue_rename(emq_client *client, const char *from, const char *to);
 int emq_queue_size(emq_client *client, const char *name);
 int emq_queue_push(emq_client *client, const char *name, emq_msg *msg);
+int emq_queue_push_batch(emq_client *client, const char *name, emq_msg **msgs, size_t count, int *statuses);
 emq_msg *emq_queue_get(emq_client *client, const char *name);
 emq_msg *emq_queue_pop(emq_client *client, const char *name, emq_time timeout);
+int emq_queue_get_into(emq_client *client, const char *name, void *data, size_t size, size_t *msg_size, emq_tag *tag);
+int emq_queue_pop_into(emq_client *client, const char *name, emq_time timeout, void *data, size_t size,
+	size_t *msg_size, emq_tag *tag);
+int emq_queue_pop_batch(emq_client *client, const char *name, emq_time timeout, emq_msg **msgs, size_t count);
+int emq_queue_prefetch(emq_client *client, const char *name, emq_time timeout, size_t window);
 int emq_queue_confirm(emq_client *client, const char *name, emq_tag tag);
+int emq_queue_inbox(emq_client *client, const char *name, const emq_inbox_limits *limits);
+int emq_queue_inbox_stat(emq_client *client, const char *name, emq_inbox_stats *stats);
+int emq_channel_inbox(emq_client *client, const char *name, const char *topic, const emq_inbox_limits *limits);
+int emq_channel_inbox_stat(emq_client *client, const char *name, const char *topic, emq_inbox_stats *stats);
+int emq_inbox_process(emq_client *client, int count);
+int emq_queue_batch(emq_client *client, const char *name, emq_batch_callback *callback,
+	size_t max_count, size_t max_bytes);
+int emq_channel_batch(emq_client *client, const char *name, const char *topic, emq_batch_callback *callback,
+	size_t max_count, size_t max_bytes);
+int emq_queue_confirm_setup(emq_client *client, size_t count, uint32_t delay, emq_confirm_callback *callback);
+int emq_queue_confirm_defer(emq_client *client, const char *name, emq_tag tag);
+int emq_queue_confirm_flush(emq_client *client);
 int emq_queue_subscribe(emq_client *client, const char *name, uint32_t flags, emq_msg_callback *callback);
+int emq_queue_drain(emq_client *client, const char *name, emq_time timeout, size_t batch);
 int emq_queue_unsubscribe(emq_client *client, const char *name);
 int emq_queue_purge(emq_client *client, const char *name);
 int emq_queue_delete(emq_client *client, const char *name);
@@ -307,10 +460,30 @@ int emq_channel_unsubscribe(emq_client *client, const char *name, const char *to
 int emq_channel_punsubscribe(emq_client *client, const char *name, const char *pattern);
 int emq_channel_delete(emq_client *client, const char *name);
 
+emq_queue_handle *emq_queue_handle_create(const char *name);
+emq_route_handle *emq_route_handle_create(const char *name, const char *key);
+emq_channel_handle *emq_channel_handle_create(const char *name, const char *topic);
+void emq_queue_handle_release(emq_queue_handle *handle);
+void emq_route_handle_release(emq_route_handle *handle);
+void emq_channel_handle_release(emq_channel_handle *handle);
+int emq_queue_push_handle(emq_client *client, emq_queue_handle *handle, emq_msg *msg);
+int emq_route_push_handle(emq_client *client, emq_route_handle *handle, emq_msg *msg);
+int emq_channel_publish_handle(emq_client *client, emq_channel_handle *handle, emq_msg *msg);
+
+int emq_pipeline_begin(emq_client *client);
+int emq_pipeline_exec(emq_client *client, int *statuses);
+void emq_pipeline_discard(emq_client *client);
+size_t emq_pipeline_length(emq_client *client);
+
 void emq_noack_enable(emq_client *client);
 void emq_noack_disable(emq_client *client);
+int emq_noack_window(emq_client *client, size_t count, uint32_t interval);
+int emq_noack_sync(emq_client *client);
+void emq_noack_stat(emq_client *client, emq_noack_stats *stats);
 
 int emq_process(emq_client *client);
+int emq_process_once(emq_client *client, int count);
+int emq_process_timeout(emq_client *client, int timeout);
 
 char *emq_last_error(emq_client *client);
 int emq_version(void);
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "emq.h"
+#include "async.h"
+
+#define GREEN(text) "\033[0;32m" text "\033[0;0m"
+#define RED(text) "\033[0;31m" text "\033[0;0m"
+#define YELLOW(text) "\033[0;33m" text "\033[0;0m"
+#define MAGENTA(text) "\033[0;35m" text "\033[0;0m"
+
+#define CHECK_STATUS(text, status) \
+	if (status == EMQ_ERROR_NONE) \
+		printf(GREEN("[Success]") " %s\n", text); \
+	else \
+		printf(RED("[Error]") " %s\n", text);
+
+#define NOTUSED(V) ((void) V)
+
+#define ADDR "localhost"
+#define TEST_MESSAGE "Hello EagleMQ"
+#define MESSAGES 1000
+
+static int pushed = 0;
+static int done = 0;
+
+static void status_callback(emq_async_context *context, int status, emq_msg *msg, void *data)
+{
+	NOTUSED(context);
+	NOTUSED(msg);
+
+	CHECK_STATUS((char*)data, status);
+}
+
+static void push_callback(emq_async_context *context, int status, emq_msg *msg, void *data)
+{
+	NOTUSED(context);
+	NOTUSED(msg);
+	NOTUSED(data);
+
+	if (status == EMQ_ERROR_NONE) {
+		pushed++;
+	}
+}
+
+static void get_callback(emq_async_context *context, int status, emq_msg *msg, void *data)
+{
+	NOTUSED(context);
+	NOTUSED(data);
+
+	CHECK_STATUS("Queue get", status);
+
+	if (msg != NULL) {
+		printf(YELLOW("[Success]") " Pushed %d messages, first message: %s\n", pushed, (char*)emq_msg_data(msg));
+		emq_msg_release(msg);
+	}
+
+	done = 1;
+}
+
+int main(void)
+{
+	emq_async_context *context = emq_async_tcp_connect(ADDR, EMQ_DEFAULT_PORT);
+	emq_msg *msg = emq_msg_create((char*)TEST_MESSAGE, strlen(TEST_MESSAGE) + 1, EMQ_ZEROCOPY_ON);
+	struct pollfd pfd;
+	int i;
+
+	printf(MAGENTA("This is a simple example of using libemq async API\n"));
+	printf(MAGENTA("libemq version: %d.%d\n"), EMQ_VERSION_MAJOR, EMQ_VERSION_MINOR);
+
+	if (context != NULL)
+	{
+		printf(YELLOW("[Success]") " Connected to %s:%d\n", ADDR, EMQ_DEFAULT_PORT);
+
+		/* Commands are only buffered here */
+		emq_async_auth(context, "eagle", "eagle", status_callback, (char*)"Auth");
+		emq_async_queue_declare(context, ".queue-async", status_callback, (char*)"Queue declare");
+
+		for (i = 0; i < MESSAGES; i++) {
+			emq_async_queue_push(context, ".queue-async", msg, push_callback, NULL);
+		}
+
+		emq_async_queue_get(context, ".queue-async", get_callback, NULL);
+
+		/* Simple event loop */
+		while (!done)
+		{
+			pfd.fd = emq_async_fd(context);
+			pfd.events = POLLIN | (emq_async_want_write(context) ? POLLOUT : 0);
+
+			if (poll(&pfd, 1, -1) == -1) {
+				break;
+			}
+
+			if ((pfd.revents & POLLOUT) && emq_async_handle_write(context) == EMQ_STATUS_ERR) {
+				printf(RED("[Error]") " %s\n", emq_last_error(emq_async_client(context)));
+				break;
+			}
+
+			if ((pfd.revents & POLLIN) && emq_async_handle_read(context) == EMQ_STATUS_ERR) {
+				printf(RED("[Error]") " %s\n", emq_last_error(emq_async_client(context)));
+				break;
+			}
+		}
+
+		emq_async_disconnect(context);
+	} else {
+		printf(RED("[Error]") " Error connect to %s:%d\n", ADDR, EMQ_DEFAULT_PORT);
+	}
+
+	emq_msg_release(msg);
+
+	return 0;
+}
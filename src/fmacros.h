@@ -5,6 +5,10 @@
 	#define _BSD_SOURCE
 #endif
 
+#if !defined(_DEFAULT_SOURCE)
+	#define _DEFAULT_SOURCE
+#endif
+
 #if defined(__linux__)
 	#define _XOPEN_SOURCE 600
 #else
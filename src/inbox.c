@@ -0,0 +1,477 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "emq.h"
+#include "internal.h"
+
+#define EMQ_INBOX_INITIAL_SIZE 16
+
+#define EMQ_INBOX_ENTRY_TOPIC 1
+#define EMQ_INBOX_ENTRY_PATTERN 2
+
+static emq_inboxes *emq_inboxes_get(emq_client *client)
+{
+	emq_inboxes *inboxes;
+
+	if (client->inboxes) {
+		return client->inboxes;
+	}
+
+	inboxes = (emq_inboxes*)calloc(1, sizeof(*inboxes));
+	if (!inboxes) {
+		return NULL;
+	}
+
+	pthread_mutex_init(&inboxes->lock, NULL);
+	pthread_cond_init(&inboxes->cond, NULL);
+
+	client->inboxes = inboxes;
+
+	return inboxes;
+}
+
+void emq_inboxes_release(emq_inboxes *inboxes)
+{
+	pthread_mutex_destroy(&inboxes->lock);
+	pthread_cond_destroy(&inboxes->cond);
+	free(inboxes);
+}
+
+static int emq_inbox_high(emq_inbox *inbox)
+{
+	return (inbox->limits.max_messages && inbox->count >= inbox->limits.max_messages) ||
+		(inbox->limits.max_bytes && inbox->bytes >= inbox->limits.max_bytes);
+}
+
+static int emq_inbox_low(emq_inbox *inbox)
+{
+	return (!inbox->limits.max_messages || inbox->count <= inbox->limits.low_messages) &&
+		(!inbox->limits.max_bytes || inbox->bytes <= inbox->limits.low_bytes);
+}
+
+static void emq_inbox_update(emq_inbox *inbox)
+{
+	emq_inboxes *owner = inbox->owner;
+
+	if (!inbox->paused && inbox->limits.policy == EMQ_INBOX_BLOCK && emq_inbox_high(inbox)) {
+		inbox->paused = 1;
+		owner->paused++;
+	} else if (inbox->paused && (inbox->limits.policy != EMQ_INBOX_BLOCK || emq_inbox_low(inbox))) {
+		inbox->paused = 0;
+		owner->paused--;
+		pthread_cond_broadcast(&owner->cond);
+	}
+}
+
+static emq_inbox_entry *emq_inbox_shift(emq_inbox *inbox)
+{
+	emq_inbox_entry *entry = &inbox->entries[inbox->head];
+
+	inbox->head = (inbox->head + 1) % inbox->capacity;
+	inbox->count--;
+	inbox->bytes -= entry->msg ? entry->msg->size : 0;
+
+	return entry;
+}
+
+static int emq_inbox_grow(emq_inbox *inbox)
+{
+	emq_inbox_entry *entries;
+	size_t capacity, i;
+
+	capacity = inbox->capacity ? inbox->capacity * 2 : EMQ_INBOX_INITIAL_SIZE;
+
+	entries = (emq_inbox_entry*)malloc(sizeof(emq_inbox_entry) * capacity);
+	if (!entries) {
+		return EMQ_STATUS_ERR;
+	}
+
+	for (i = 0; i < inbox->count; i++) {
+		entries[i] = inbox->entries[(inbox->head + i) % inbox->capacity];
+	}
+
+	free(inbox->entries);
+
+	inbox->entries = entries;
+	inbox->capacity = capacity;
+	inbox->head = 0;
+
+	return EMQ_STATUS_OK;
+}
+
+void emq_inbox_push(emq_inbox *inbox, emq_msg_callback *callback, int type, const char *topic,
+	const char *pattern, emq_msg *msg)
+{
+	emq_inboxes *owner = inbox->owner;
+	size_t size = msg ? msg->size : 0;
+	emq_inbox_entry *entry;
+
+	pthread_mutex_lock(&owner->lock);
+
+	if (inbox->limits.policy == EMQ_INBOX_DROP_OLDEST)
+	{
+		while (inbox->count && ((inbox->limits.max_messages && inbox->count + 1 > inbox->limits.max_messages) ||
+			(inbox->limits.max_bytes && inbox->bytes + size > inbox->limits.max_bytes)))
+		{
+			entry = emq_inbox_shift(inbox);
+
+			if (entry->msg) {
+				emq_msg_release(entry->msg);
+			}
+
+			inbox->dropped++;
+		}
+	}
+
+	if (inbox->count == inbox->capacity && emq_inbox_grow(inbox) == EMQ_STATUS_ERR)
+	{
+		if (msg) {
+			emq_msg_release(msg);
+		}
+
+		inbox->dropped++;
+		pthread_mutex_unlock(&owner->lock);
+		return;
+	}
+
+	entry = &inbox->entries[(inbox->head + inbox->count) % inbox->capacity];
+
+	entry->callback = callback;
+	entry->type = type;
+	entry->flags = 0;
+	entry->msg = msg;
+
+	if (topic) {
+		emq_string_copy(entry->topic, topic, sizeof(entry->topic));
+		entry->flags |= EMQ_INBOX_ENTRY_TOPIC;
+	}
+
+	if (pattern) {
+		emq_string_copy(entry->pattern, pattern, sizeof(entry->pattern));
+		entry->flags |= EMQ_INBOX_ENTRY_PATTERN;
+	}
+
+	inbox->count++;
+	inbox->bytes += size;
+
+	emq_inbox_update(inbox);
+
+	pthread_mutex_unlock(&owner->lock);
+}
+
+static emq_inbox *emq_inbox_create(emq_client *client, const char *name, const emq_inbox_limits *limits)
+{
+	emq_inboxes *owner;
+	emq_inbox *inbox;
+
+	if ((owner = emq_inboxes_get(client)) == NULL) {
+		return NULL;
+	}
+
+	inbox = (emq_inbox*)calloc(1, sizeof(*inbox));
+	if (!inbox) {
+		return NULL;
+	}
+
+	inbox->owner = owner;
+	inbox->name = name;
+	inbox->limits = *limits;
+
+	pthread_mutex_lock(&owner->lock);
+
+	inbox->next = owner->head;
+
+	if (owner->head) {
+		owner->head->prev = inbox;
+	}
+
+	owner->head = inbox;
+	owner->length++;
+
+	pthread_mutex_unlock(&owner->lock);
+
+	return inbox;
+}
+
+void emq_inbox_release(emq_inbox *inbox)
+{
+	emq_inboxes *owner = inbox->owner;
+	emq_inbox_entry *entry;
+
+	pthread_mutex_lock(&owner->lock);
+
+	if (inbox->prev) {
+		inbox->prev->next = inbox->next;
+	} else {
+		owner->head = inbox->next;
+	}
+
+	if (inbox->next) {
+		inbox->next->prev = inbox->prev;
+	}
+
+	if (owner->cursor == inbox) {
+		owner->cursor = inbox->next;
+	}
+
+	owner->length--;
+
+	if (inbox->paused) {
+		owner->paused--;
+		pthread_cond_broadcast(&owner->cond);
+	}
+
+	while (inbox->count)
+	{
+		entry = emq_inbox_shift(inbox);
+
+		if (entry->msg) {
+			emq_msg_release(entry->msg);
+		}
+	}
+
+	pthread_mutex_unlock(&owner->lock);
+
+	free(inbox->entries);
+	free(inbox);
+}
+
+int emq_inbox_paused(emq_client *client)
+{
+	int paused;
+
+	pthread_mutex_lock(&client->inboxes->lock);
+	paused = client->inboxes->paused;
+	pthread_mutex_unlock(&client->inboxes->lock);
+
+	return paused;
+}
+
+void emq_inbox_wait(emq_client *client)
+{
+	emq_inboxes *inboxes = client->inboxes;
+
+	pthread_mutex_lock(&inboxes->lock);
+
+	while (inboxes->paused) {
+		pthread_cond_wait(&inboxes->cond, &inboxes->lock);
+	}
+
+	pthread_mutex_unlock(&inboxes->lock);
+}
+
+static int emq_inbox_setup(emq_client *client, emq_inbox **inbox, const char *name, const emq_inbox_limits *limits)
+{
+	if (!limits) {
+		if (*inbox) {
+			emq_inbox_release(*inbox);
+			*inbox = NULL;
+		}
+
+		return EMQ_STATUS_OK;
+	}
+
+	if (limits->policy != EMQ_INBOX_BLOCK && limits->policy != EMQ_INBOX_DROP_OLDEST) {
+		return EMQ_STATUS_ERR;
+	}
+
+	/* the callbacks may release the messages on another thread, the message pool is not thread-safe */
+	if (client->msg_pool) {
+		return EMQ_STATUS_ERR;
+	}
+
+	if (*inbox) {
+		pthread_mutex_lock(&(*inbox)->owner->lock);
+		(*inbox)->limits = *limits;
+		emq_inbox_update(*inbox);
+		pthread_mutex_unlock(&(*inbox)->owner->lock);
+		return EMQ_STATUS_OK;
+	}
+
+	*inbox = emq_inbox_create(client, name, limits);
+
+	return *inbox ? EMQ_STATUS_OK : EMQ_STATUS_ERR;
+}
+
+static void emq_inbox_stat(emq_inbox *inbox, emq_inbox_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (!inbox) {
+		return;
+	}
+
+	pthread_mutex_lock(&inbox->owner->lock);
+
+	stats->messages = inbox->count;
+	stats->bytes = inbox->bytes;
+	stats->dropped = inbox->dropped;
+	stats->paused = inbox->paused;
+
+	pthread_mutex_unlock(&inbox->owner->lock);
+}
+
+int emq_queue_inbox(emq_client *client, const char *name, const emq_inbox_limits *limits)
+{
+	emq_queue_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_queue_subscription_find(client, name)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_inbox_setup(client, &subscription->inbox, subscription->name, limits) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_queue_inbox_stat(emq_client *client, const char *name, emq_inbox_stats *stats)
+{
+	emq_queue_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_queue_subscription_find(client, name)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	emq_inbox_stat(subscription->inbox, stats);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+int emq_channel_inbox(emq_client *client, const char *name, const char *topic, const emq_inbox_limits *limits)
+{
+	emq_channel_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_channel_subscription_get(client, name, topic)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	if (emq_inbox_setup(client, &subscription->inbox, subscription->name, limits) == EMQ_STATUS_ERR) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		goto error;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+
+error:
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return EMQ_STATUS_ERR;
+}
+
+int emq_channel_inbox_stat(emq_client *client, const char *name, const char *topic, emq_inbox_stats *stats)
+{
+	emq_channel_subscription *subscription;
+
+	EMQ_CLEAR_ERROR(client);
+
+	if ((subscription = emq_channel_subscription_get(client, name, topic)) == NULL) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	emq_inbox_stat(subscription->inbox, stats);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
+
+int emq_inbox_process(emq_client *client, int count)
+{
+	emq_inboxes *inboxes = client->inboxes;
+	emq_inbox_entry entry;
+	emq_inbox *inbox;
+	const char *name;
+	int processed = 0;
+	size_t idle = 0;
+
+	if (!inboxes) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&inboxes->lock);
+
+	/* round-robin over the inboxes, one message at a time */
+	while ((count <= 0 || processed < count) && inboxes->head)
+	{
+		inbox = inboxes->cursor ? inboxes->cursor : inboxes->head;
+		inboxes->cursor = inbox->next;
+
+		if (!inbox->count)
+		{
+			if (++idle >= inboxes->length) {
+				break;
+			}
+
+			continue;
+		}
+
+		entry = *emq_inbox_shift(inbox);
+		name = inbox->name;
+		emq_inbox_update(inbox);
+		idle = 0;
+
+		pthread_mutex_unlock(&inboxes->lock);
+
+		/* the client may be read by another thread meanwhile, the callback must not use it then */
+		entry.callback(client, entry.type, name,
+			(entry.flags & EMQ_INBOX_ENTRY_TOPIC) ? entry.topic : NULL,
+			(entry.flags & EMQ_INBOX_ENTRY_PATTERN) ? entry.pattern : NULL, entry.msg);
+
+		processed++;
+
+		pthread_mutex_lock(&inboxes->lock);
+	}
+
+	pthread_mutex_unlock(&inboxes->lock);
+
+	return processed;
+}
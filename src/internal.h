@@ -0,0 +1,240 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _EMQ_INTERNAL_H_
+#define _EMQ_INTERNAL_H_
+
+#include <pthread.h>
+
+#include "emq.h"
+#include "protocol.h"
+
+#define EMQ_DICT_INITIAL_SIZE 16
+
+#define EMQ_DICT_LENGTH(d) ((d)->count)
+
+/* A message body plus the fixed part of its request must fit the 32-bit bodylen */
+#define EMQ_MSG_SIZE_VALID(msg, fixed) ((msg)->size >= 1 && (msg)->size <= EMQ_MAX_REQUEST_SIZE - (fixed))
+#define EMQ_DICT_SET_FREE_METHOD(d, m) ((d)->free = (m))
+
+typedef struct emq_dict_iterator {
+	emq_dict *dict;
+	size_t index;
+	emq_dict_entry *next;
+} emq_dict_iterator;
+
+typedef struct emq_inbox_entry {
+	emq_msg_callback *callback;
+	int type;
+	int flags;
+	char topic[33];
+	char pattern[33];
+	emq_msg *msg;
+} emq_inbox_entry;
+
+typedef struct emq_inbox {
+	struct emq_inboxes *owner;
+	const char *name;
+	emq_inbox_limits limits;
+	emq_inbox_entry *entries;
+	size_t head;
+	size_t count;
+	size_t capacity;
+	size_t bytes;
+	uint64_t dropped;
+	int paused;
+	struct emq_inbox *prev;
+	struct emq_inbox *next;
+} emq_inbox;
+
+typedef struct emq_inboxes {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	emq_inbox *head;
+	emq_inbox *cursor;
+	size_t length;
+	int paused;
+} emq_inboxes;
+
+typedef struct emq_batcher {
+	emq_client *client;
+	emq_batch_callback *callback;
+	size_t max_count;
+	size_t max_bytes;
+	emq_batch batch;
+	char (*topics)[33];
+	int pending;
+	int flushing;
+	int released;
+	struct emq_batcher *next;
+} emq_batcher;
+
+struct emq_queue_handle {
+	protocol_request_queue_push request;
+};
+
+struct emq_route_handle {
+	protocol_request_route_push request;
+};
+
+struct emq_channel_handle {
+	protocol_request_channel_publish request;
+};
+
+typedef struct emq_drain {
+	emq_client *client;
+	struct emq_queue_subscription *subscription;
+	emq_time timeout;
+	size_t batch;
+	int pending;
+	int inflight;
+	int again;
+	int empty;
+	int released;
+	struct emq_drain *next;
+} emq_drain;
+
+typedef struct emq_queue_subscription {
+	char name[64];
+	uint32_t flags;
+	emq_msg_callback *callback;
+	emq_inbox *inbox;
+	emq_batcher *batcher;
+	emq_drain *drain;
+} emq_queue_subscription;
+
+#define EMQ_PATTERN_EXACT 0
+#define EMQ_PATTERN_PREFIX 1
+#define EMQ_PATTERN_GLOB 2
+
+#define EMQ_PATTERN_OP_CHAR 0
+#define EMQ_PATTERN_OP_ANY 1
+#define EMQ_PATTERN_OP_STAR 2
+#define EMQ_PATTERN_OP_CLASS 3
+
+typedef struct emq_pattern_op {
+	uint8_t type;
+	uint8_t c;
+	uint8_t set[32];
+} emq_pattern_op;
+
+typedef struct emq_pattern {
+	int type;
+	size_t length;
+	size_t count;
+	emq_pattern_op *ops;
+} emq_pattern;
+
+typedef struct emq_channel_subscription {
+	char name[64];
+	char channel[32];
+	int pattern;
+	emq_pattern matcher;
+	emq_msg_callback *callback;
+	emq_inbox *inbox;
+	emq_batcher *batcher;
+} emq_channel_subscription;
+
+typedef struct emq_channel_table {
+	char name[64];
+	emq_dict *topics;
+	emq_dict *patterns;
+} emq_channel_table;
+
+typedef struct emq_backoff {
+	uint32_t min_delay;
+	uint32_t max_delay;
+	uint32_t limit;
+	uint32_t seed;
+} emq_backoff;
+
+void emq_client_set_error(emq_client *client, int error);
+void emq_string_copy(char *dst, const char *src, size_t size);
+void emq_deadline(struct timespec *ts, int timeout);
+
+void emq_backoff_init(emq_backoff *backoff, uint32_t min_delay, uint32_t max_delay, uint32_t seed);
+void emq_backoff_reset(emq_backoff *backoff);
+uint32_t emq_backoff_next(emq_backoff *backoff);
+
+unsigned int emq_dict_hash(const char *key);
+emq_dict *emq_dict_init(void);
+int emq_dict_add(emq_dict *dict, const char *key, void *value);
+emq_dict_entry *emq_dict_find(emq_dict *dict, const char *key, unsigned int hash);
+int emq_dict_delete(emq_dict *dict, const char *key, unsigned int hash);
+void emq_dict_release(emq_dict *dict);
+void emq_dict_rewind(emq_dict *dict, emq_dict_iterator *iter);
+emq_dict_entry *emq_dict_next(emq_dict_iterator *iter);
+
+int emq_msg_iov(emq_msg *msg, struct iovec *iov);
+
+emq_msg *emq_msg_pool_alloc(emq_msg_pool *pool, size_t size);
+void emq_msg_pool_free(emq_msg *msg);
+void emq_msg_pool_detach(emq_client *client);
+
+int emq_queue_subscription_add(emq_client *client, const char *name, uint32_t flags, emq_msg_callback *callback);
+emq_queue_subscription *emq_queue_subscription_find(emq_client *client, const char *name);
+void emq_queue_subscription_delete(emq_client *client, const char *name);
+
+int emq_pattern_compile(emq_pattern *pattern, const char *text);
+int emq_pattern_match(const emq_pattern *pattern, const char *text, const char *str);
+void emq_pattern_release(emq_pattern *pattern);
+
+int emq_channel_subscription_add(emq_client *client, const char *name, const char *channel, int pattern,
+	emq_msg_callback *callback);
+emq_channel_subscription *emq_channel_subscription_find(emq_client *client, const char *name,
+	const char *topic, const char *pattern);
+void emq_channel_subscription_delete(emq_client *client, const char *name, const char *channel, int pattern);
+emq_channel_subscription *emq_channel_subscription_get(emq_client *client, const char *name, const char *channel);
+
+void emq_inbox_push(emq_inbox *inbox, emq_msg_callback *callback, int type, const char *topic,
+	const char *pattern, emq_msg *msg);
+void emq_inbox_release(emq_inbox *inbox);
+void emq_inboxes_release(emq_inboxes *inboxes);
+int emq_inbox_paused(emq_client *client);
+void emq_inbox_wait(emq_client *client);
+
+int emq_batcher_push(emq_batcher *batcher, const char *topic, emq_msg *msg);
+void emq_batcher_release(emq_batcher *batcher);
+int emq_batch_flush(emq_client *client);
+
+int emq_pipeline_active(emq_client *client);
+
+int emq_event_dispatch(emq_client *client, protocol_event_header *header, const char *body);
+int emq_queue_deliver(emq_client *client, emq_queue_subscription *subscription, emq_msg *msg);
+
+void emq_drain_mark(emq_drain *drain);
+void emq_drain_release(emq_drain *drain);
+int emq_drain_flush(emq_client *client);
+
+void emq_dispatcher_submit(emq_client *client, emq_msg_callback *callback,
+	int type, const char *name, const char *topic, const char *pattern, emq_msg *msg);
+int emq_dispatch_in_callback(void);
+int emq_dispatch_flush(emq_client *client);
+void emq_dispatch_drop(emq_client *client);
+void emq_dispatch_unlink(emq_client *client);
+
+#endif
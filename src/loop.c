@@ -0,0 +1,326 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "emq.h"
+#include "async.h"
+#include "loop.h"
+
+typedef struct emq_loop_entry {
+	struct emq_loop *loop;
+	emq_async_context *context;
+	int pending;
+	struct emq_loop_entry *next;
+	struct emq_loop_entry *prev_entry;
+	struct emq_loop_entry *next_entry;
+} emq_loop_entry;
+
+struct emq_loop {
+	int fd;
+	int stop;
+	size_t count;
+	struct epoll_event *events;
+	int size;
+	emq_loop_entry *entries;
+	emq_loop_entry *pending;
+	emq_loop_entry *garbage;
+	emq_loop_error_callback *error_callback;
+	void *data;
+};
+
+emq_loop *emq_loop_create(int size)
+{
+	emq_loop *loop;
+
+	if (size <= 0) {
+		size = EMQ_DEFAULT_LOOP_EVENTS;
+	}
+
+	loop = (emq_loop*)calloc(1, sizeof(*loop));
+	if (!loop) {
+		return NULL;
+	}
+
+	loop->events = (struct epoll_event*)malloc(sizeof(struct epoll_event) * size);
+	loop->size = size;
+
+	if (!loop->events) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->fd = epoll_create(size);
+
+	if (loop->fd == -1) {
+		free(loop->events);
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+static void emq_loop_collect(emq_loop *loop)
+{
+	emq_loop_entry *entry;
+
+	while ((entry = loop->garbage) != NULL) {
+		loop->garbage = entry->next;
+		free(entry);
+	}
+}
+
+static void emq_loop_add_write(void *data)
+{
+	emq_loop_entry *entry = data;
+
+	if (entry->pending) {
+		return;
+	}
+
+	entry->pending = 1;
+	entry->next = entry->loop->pending;
+	entry->loop->pending = entry;
+}
+
+static void emq_loop_cleanup(void *data)
+{
+	emq_loop_entry *entry = data;
+
+	emq_loop_delete(entry->loop, entry->context);
+}
+
+int emq_loop_add(emq_loop *loop, emq_async_context *context)
+{
+	struct epoll_event ev;
+	emq_loop_entry *entry;
+
+	if (context->ev.data) {
+		return EMQ_STATUS_ERR;
+	}
+
+	entry = (emq_loop_entry*)calloc(1, sizeof(*entry));
+	if (!entry) {
+		return EMQ_STATUS_ERR;
+	}
+
+	entry->loop = loop;
+	entry->context = context;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = entry;
+
+	if (epoll_ctl(loop->fd, EPOLL_CTL_ADD, emq_async_fd(context), &ev) == -1) {
+		free(entry);
+		return EMQ_STATUS_ERR;
+	}
+
+	context->ev.data = entry;
+	context->ev.add_write = emq_loop_add_write;
+	context->ev.cleanup = emq_loop_cleanup;
+
+	if (emq_async_want_write(context)) {
+		emq_loop_add_write(entry);
+	}
+
+	entry->next_entry = loop->entries;
+
+	if (loop->entries) {
+		loop->entries->prev_entry = entry;
+	}
+
+	loop->entries = entry;
+	loop->count++;
+
+	return EMQ_STATUS_OK;
+}
+
+int emq_loop_delete(emq_loop *loop, emq_async_context *context)
+{
+	emq_loop_entry *entry = context->ev.data;
+	struct epoll_event ev;
+
+	if (!entry || entry->loop != loop) {
+		return EMQ_STATUS_ERR;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(loop->fd, EPOLL_CTL_DEL, emq_async_fd(context), &ev);
+
+	memset(&context->ev, 0, sizeof(context->ev));
+
+	entry->context = NULL;
+
+	if (entry->prev_entry) {
+		entry->prev_entry->next_entry = entry->next_entry;
+	} else {
+		loop->entries = entry->next_entry;
+	}
+
+	if (entry->next_entry) {
+		entry->next_entry->prev_entry = entry->prev_entry;
+	}
+
+	/* pending entries are freed when the pending list is flushed */
+	if (!entry->pending) {
+		entry->next = loop->garbage;
+		loop->garbage = entry;
+	}
+
+	loop->count--;
+
+	return EMQ_STATUS_OK;
+}
+
+void emq_loop_set_error_callback(emq_loop *loop, emq_loop_error_callback *callback, void *data)
+{
+	loop->error_callback = callback;
+	loop->data = data;
+}
+
+size_t emq_loop_length(emq_loop *loop)
+{
+	return loop->count;
+}
+
+static void emq_loop_error(emq_loop *loop, emq_async_context *context)
+{
+	emq_loop_delete(loop, context);
+
+	if (loop->error_callback) {
+		loop->error_callback(loop, context, loop->data);
+	} else {
+		emq_async_disconnect(context);
+	}
+}
+
+static void emq_loop_flush(emq_loop *loop)
+{
+	emq_loop_entry *entry;
+
+	while ((entry = loop->pending) != NULL)
+	{
+		loop->pending = entry->next;
+		entry->pending = 0;
+
+		if (!entry->context) {
+			free(entry);
+			continue;
+		}
+
+		if (emq_async_handle_write(entry->context) == EMQ_STATUS_ERR) {
+			emq_loop_error(loop, entry->context);
+		}
+	}
+}
+
+int emq_loop_run_once(emq_loop *loop, int timeout)
+{
+	emq_loop_entry *entry;
+	uint32_t events;
+	int count, i;
+
+	emq_loop_flush(loop);
+
+	if (loop->pending) {
+		timeout = 0;
+	}
+
+	count = epoll_wait(loop->fd, loop->events, loop->size, timeout);
+
+	if (count == -1) {
+		return errno == EINTR ? 0 : EMQ_STATUS_ERR;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		entry = loop->events[i].data.ptr;
+		events = loop->events[i].events;
+
+		if (entry->context && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+			emq_async_handle_read(entry->context) == EMQ_STATUS_ERR) {
+			emq_loop_error(loop, entry->context);
+			continue;
+		}
+
+		if (entry->context && (events & EPOLLOUT) && emq_async_want_write(entry->context) &&
+			emq_async_handle_write(entry->context) == EMQ_STATUS_ERR) {
+			emq_loop_error(loop, entry->context);
+		}
+	}
+
+	emq_loop_collect(loop);
+
+	return count;
+}
+
+int emq_loop_run(emq_loop *loop)
+{
+	loop->stop = 0;
+
+	while (!loop->stop && loop->count)
+	{
+		if (emq_loop_run_once(loop, -1) == EMQ_STATUS_ERR) {
+			return EMQ_STATUS_ERR;
+		}
+	}
+
+	return EMQ_STATUS_OK;
+}
+
+void emq_loop_stop(emq_loop *loop)
+{
+	loop->stop = 1;
+}
+
+void emq_loop_release(emq_loop *loop)
+{
+	emq_loop_entry *entry;
+
+	/* contexts still registered are detached, not closed */
+	while (loop->entries) {
+		emq_loop_delete(loop, loop->entries->context);
+	}
+
+	while ((entry = loop->pending) != NULL) {
+		loop->pending = entry->next;
+		free(entry);
+	}
+
+	emq_loop_collect(loop);
+
+	close(loop->fd);
+	free(loop->events);
+	free(loop);
+}
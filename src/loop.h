@@ -0,0 +1,52 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _EMQ_LOOP_H_
+#define _EMQ_LOOP_H_
+
+#include "emq.h"
+#include "async.h"
+
+#define EMQ_DEFAULT_LOOP_EVENTS 1024
+
+typedef struct emq_loop emq_loop;
+
+typedef void emq_loop_error_callback(emq_loop *loop, emq_async_context *context, void *data);
+
+emq_loop *emq_loop_create(int size);
+void emq_loop_release(emq_loop *loop);
+
+int emq_loop_add(emq_loop *loop, emq_async_context *context);
+int emq_loop_delete(emq_loop *loop, emq_async_context *context);
+void emq_loop_set_error_callback(emq_loop *loop, emq_loop_error_callback *callback, void *data);
+size_t emq_loop_length(emq_loop *loop);
+
+int emq_loop_run_once(emq_loop *loop, int timeout);
+int emq_loop_run(emq_loop *loop);
+void emq_loop_stop(emq_loop *loop);
+
+#endif
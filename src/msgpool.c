@@ -0,0 +1,346 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emq.h"
+#include "internal.h"
+
+typedef struct emq_msg_pool_block {
+	struct emq_msg_pool_block *next;
+} emq_msg_pool_block;
+
+typedef struct emq_msg_pool_class {
+	emq_msg_pool_block *blocks;
+	size_t used;
+	size_t cached;
+	size_t high_water;
+} emq_msg_pool_class;
+
+struct emq_msg_pool {
+	uint32_t flags;
+	size_t max_cached;
+	int released;
+	size_t attached;
+	uint64_t hits;
+	uint64_t misses;
+	size_t used;
+	size_t high_water;
+	emq_msg_pool_block *headers;
+	size_t headers_cached;
+	emq_msg_pool_class classes[EMQ_MSG_POOL_CLASSES];
+};
+
+#define EMQ_MSG_POOL_CLASS_SIZE(index) ((size_t)EMQ_MSG_POOL_MIN_SIZE << (index))
+#define EMQ_MSG_POOL_BLOCK_SIZE(pool, size) \
+	(((pool)->flags & EMQ_MSG_POOL_SINGLE_BLOCK) ? sizeof(emq_msg) + (size) : (size))
+
+static int emq_msg_pool_class_index(size_t size)
+{
+	int index;
+
+	for (index = 0; index < EMQ_MSG_POOL_CLASSES; index++)
+	{
+		if (size <= EMQ_MSG_POOL_CLASS_SIZE(index)) {
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+static void emq_msg_pool_free_blocks(emq_msg_pool_block *block)
+{
+	emq_msg_pool_block *next;
+
+	while (block) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+static void emq_msg_pool_free_all(emq_msg_pool *pool)
+{
+	int index;
+
+	for (index = 0; index < EMQ_MSG_POOL_CLASSES; index++) {
+		emq_msg_pool_free_blocks(pool->classes[index].blocks);
+	}
+
+	emq_msg_pool_free_blocks(pool->headers);
+	free(pool);
+}
+
+static void *emq_msg_pool_block_get(emq_msg_pool *pool, int index)
+{
+	emq_msg_pool_class *size_class = &pool->classes[index];
+	emq_msg_pool_block *block;
+
+	if (size_class->blocks) {
+		block = size_class->blocks;
+		size_class->blocks = block->next;
+		size_class->cached--;
+		pool->hits++;
+	} else {
+		block = (emq_msg_pool_block*)malloc(EMQ_MSG_POOL_CLASS_SIZE(index));
+		if (!block) {
+			return NULL;
+		}
+		pool->misses++;
+	}
+
+	if (++size_class->used > size_class->high_water) {
+		size_class->high_water = size_class->used;
+	}
+
+	return block;
+}
+
+static void emq_msg_pool_block_put(emq_msg_pool *pool, int index, void *ptr)
+{
+	emq_msg_pool_class *size_class = &pool->classes[index];
+	emq_msg_pool_block *block = (emq_msg_pool_block*)ptr;
+
+	size_class->used--;
+
+	if (pool->released || size_class->cached >= pool->max_cached) {
+		free(block);
+		return;
+	}
+
+	block->next = size_class->blocks;
+	size_class->blocks = block;
+	size_class->cached++;
+}
+
+emq_msg_pool *emq_msg_pool_create(uint32_t flags, size_t max_cached)
+{
+	emq_msg_pool *pool;
+
+	pool = (emq_msg_pool*)calloc(1, sizeof(*pool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->flags = flags;
+	pool->max_cached = max_cached;
+
+	return pool;
+}
+
+void emq_msg_pool_release(emq_msg_pool *pool)
+{
+	if (pool->used || pool->attached) {
+		pool->released = 1;
+		return;
+	}
+
+	emq_msg_pool_free_all(pool);
+}
+
+emq_msg *emq_msg_pool_alloc(emq_msg_pool *pool, size_t size)
+{
+	emq_msg_pool_block *header;
+	emq_msg *msg;
+	void *data;
+	int index;
+
+	if (!pool || (index = emq_msg_pool_class_index(EMQ_MSG_POOL_BLOCK_SIZE(pool, size))) == -1)
+	{
+		if (pool) {
+			pool->misses++;
+		}
+
+		msg = (emq_msg*)malloc(sizeof(*msg));
+		if (!msg) {
+			return NULL;
+		}
+
+		msg->data = malloc(size);
+		if (!msg->data) {
+			free(msg);
+			return NULL;
+		}
+
+		msg->pool = NULL;
+	}
+	else if (pool->flags & EMQ_MSG_POOL_SINGLE_BLOCK)
+	{
+		msg = (emq_msg*)emq_msg_pool_block_get(pool, index);
+		if (!msg) {
+			return NULL;
+		}
+
+		msg->data = (char*)msg + sizeof(emq_msg);
+		msg->pool = pool;
+	}
+	else
+	{
+		if (pool->headers) {
+			header = pool->headers;
+			pool->headers = header->next;
+			pool->headers_cached--;
+			msg = (emq_msg*)header;
+		} else {
+			msg = (emq_msg*)malloc(sizeof(*msg));
+			if (!msg) {
+				return NULL;
+			}
+		}
+
+		data = emq_msg_pool_block_get(pool, index);
+		if (!data) {
+			free(msg);
+			return NULL;
+		}
+
+		msg->data = data;
+		msg->pool = pool;
+	}
+
+	msg->size = size;
+	msg->tag = 0;
+	msg->expire = 0;
+	msg->zero_copy = EMQ_ZEROCOPY_OFF;
+	msg->refcount = 1;
+	msg->shared = NULL;
+	msg->iov = NULL;
+	msg->iovcnt = 0;
+
+	if (msg->pool && ++pool->used > pool->high_water) {
+		pool->high_water = pool->used;
+	}
+
+	return msg;
+}
+
+void emq_msg_pool_free(emq_msg *msg)
+{
+	emq_msg_pool *pool = msg->pool;
+	emq_msg_pool_block *header;
+	int index;
+
+	index = emq_msg_pool_class_index(EMQ_MSG_POOL_BLOCK_SIZE(pool, msg->size));
+
+	if (pool->flags & EMQ_MSG_POOL_SINGLE_BLOCK) {
+		emq_msg_pool_block_put(pool, index, msg);
+	} else {
+		emq_msg_pool_block_put(pool, index, msg->data);
+
+		if (pool->released || pool->headers_cached >= pool->max_cached) {
+			free(msg);
+		} else {
+			header = (emq_msg_pool_block*)msg;
+			header->next = pool->headers;
+			pool->headers = header;
+			pool->headers_cached++;
+		}
+	}
+
+	if (!--pool->used && pool->released && !pool->attached) {
+		emq_msg_pool_free_all(pool);
+	}
+}
+
+emq_msg *emq_msg_pool_get(emq_msg_pool *pool, void *data, size_t size)
+{
+	emq_msg *msg;
+
+	msg = emq_msg_pool_alloc(pool, size);
+	if (!msg) {
+		return NULL;
+	}
+
+	if (data) {
+		memcpy(msg->data, data, size);
+	}
+
+	return msg;
+}
+
+void emq_msg_pool_stat(emq_msg_pool *pool, emq_msg_pool_stats *stats)
+{
+	int index;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->hits = pool->hits;
+	stats->misses = pool->misses;
+	stats->hit_rate = (pool->hits + pool->misses) ?
+		(float)pool->hits / (float)(pool->hits + pool->misses) : 0;
+	stats->used = pool->used;
+	stats->high_water = pool->high_water;
+
+	for (index = 0; index < EMQ_MSG_POOL_CLASSES; index++)
+	{
+		stats->classes[index].size = EMQ_MSG_POOL_CLASS_SIZE(index);
+		stats->classes[index].used = pool->classes[index].used;
+		stats->classes[index].cached = pool->classes[index].cached;
+		stats->classes[index].high_water = pool->classes[index].high_water;
+		stats->cached += pool->classes[index].cached;
+	}
+}
+
+void emq_msg_pool_detach(emq_client *client)
+{
+	emq_msg_pool *pool = client->msg_pool;
+
+	if (!pool) {
+		return;
+	}
+
+	client->msg_pool = NULL;
+
+	if (!--pool->attached && pool->released && !pool->used) {
+		emq_msg_pool_free_all(pool);
+	}
+}
+
+int emq_msg_pool_attach(emq_client *client, emq_msg_pool *pool)
+{
+	EMQ_CLEAR_ERROR(client);
+
+	/* the messages of a dispatched client or of its inboxes are released by other threads */
+	if (pool && (client->dispatch || client->inboxes)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return EMQ_STATUS_ERR;
+	}
+
+	if (pool) {
+		pool->attached++;
+	}
+
+	emq_msg_pool_detach(client);
+	client->msg_pool = pool;
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return EMQ_STATUS_OK;
+}
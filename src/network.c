@@ -32,6 +32,8 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <time.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
@@ -40,10 +42,12 @@
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <stdarg.h>
 
 #include "emq.h"
 #include "network.h"
+#include "internal.h"
 
 static void net_set_error(char *err, const char *fmt,...)
 {
@@ -140,23 +144,108 @@ int emq_client_unix_connect(emq_client *client, const char *path)
 	return EMQ_NET_OK;
 }
 
+/* A buffer grown for a large frame goes back to the default size once it holds little again */
+static void emq_client_shrink(emq_client *client, size_t need)
+{
+	size_t available = client->input_len - client->input_pos;
+	char *input;
+
+	if (client->input_size <= EMQ_DEFAULT_INPUT_SIZE || need > EMQ_DEFAULT_INPUT_SIZE ||
+		available > EMQ_DEFAULT_INPUT_SIZE) {
+		return;
+	}
+
+	memmove(client->input, client->input + client->input_pos, available);
+	client->input_pos = 0;
+	client->input_len = available;
+
+	input = (char*)realloc(client->input, EMQ_DEFAULT_INPUT_SIZE);
+	if (input) {
+		client->input = input;
+		client->input_size = EMQ_DEFAULT_INPUT_SIZE;
+	}
+}
+
 int emq_client_read(emq_client *client, char *buf, int count)
 {
 	int nread, totlen = 0;
+	size_t available;
 
 	while (totlen != count)
 	{
-		nread = read(client->fd, buf, count-totlen);
+		available = client->input_len - client->input_pos;
 
-		if (nread == -1 || nread == 0) return -1;
+		if (available) {
+			if (available > (size_t)(count-totlen)) {
+				available = count-totlen;
+			}
+
+			memcpy(buf, client->input + client->input_pos, available);
+			client->input_pos += available;
+
+			totlen += available;
+			buf += available;
+			continue;
+		}
+
+		client->input_pos = client->input_len = 0;
+		emq_client_shrink(client, 0);
+
+		/* large payloads go straight to the caller buffer */
+		if ((size_t)(count-totlen) >= client->input_size) {
+			nread = read(client->fd, buf, count-totlen);
 
-		totlen += nread;
-		buf += nread;
+			if (nread == -1 && errno == EINTR) continue;
+			if (nread == -1 || nread == 0) return -1;
+
+			totlen += nread;
+			buf += nread;
+		} else {
+			nread = read(client->fd, client->input, client->input_size);
+
+			if (nread == -1 && errno == EINTR) continue;
+			if (nread == -1 || nread == 0) return -1;
+
+			client->input_len = nread;
+		}
 	}
 
 	return totlen;
 }
 
+int emq_client_skip(emq_client *client, size_t count)
+{
+	size_t available;
+	ssize_t nread;
+
+	while (count)
+	{
+		available = client->input_len - client->input_pos;
+
+		if (available) {
+			if (available > count) {
+				available = count;
+			}
+
+			client->input_pos += available;
+			count -= available;
+			continue;
+		}
+
+		client->input_pos = client->input_len = 0;
+		emq_client_shrink(client, 0);
+
+		nread = read(client->fd, client->input, client->input_size);
+
+		if (nread == -1 && errno == EINTR) continue;
+		if (nread == -1 || nread == 0) return -1;
+
+		client->input_len = nread;
+	}
+
+	return 0;
+}
+
 int emq_client_write(emq_client *client, char *buf, int count)
 {
 	int nwritten, totlen = 0;
@@ -177,14 +266,179 @@ int emq_client_write(emq_client *client, char *buf, int count)
 
 int emq_client_writev(emq_client *client, struct iovec *iov, int iovcnt)
 {
-	int ret;
+	ssize_t nwritten;
+	int count, totlen = 0;
+
+	while (iovcnt > 0)
+	{
+		count = iovcnt > EMQ_IOV_MAX ? EMQ_IOV_MAX : iovcnt;
+
+		nwritten = writev(client->fd, iov, count);
+
+		if (nwritten == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		totlen += nwritten;
+
+		while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+			nwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0 && nwritten > 0) {
+			iov->iov_base = (char*)iov->iov_base + nwritten;
+			iov->iov_len -= nwritten;
+		}
+	}
+
+	return totlen;
+}
+
+int emq_client_set_nonblock(emq_client *client, int nonblock)
+{
+	int flags;
+
+	if ((flags = fcntl(client->fd, F_GETFL)) == -1) {
+		net_set_error(client->error, "fcntl: %s", strerror(errno));
+		return EMQ_NET_ERR;
+	}
+
+	if (nonblock) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+
+	if (fcntl(client->fd, F_SETFL, flags) == -1) {
+		net_set_error(client->error, "fcntl: %s", strerror(errno));
+		return EMQ_NET_ERR;
+	}
+
+	return EMQ_NET_OK;
+}
+
+int emq_client_nonblocking(emq_client *client)
+{
+	int flags = fcntl(client->fd, F_GETFL);
+
+	return flags != -1 && (flags & O_NONBLOCK);
+}
+
+int emq_client_fill(emq_client *client, size_t need)
+{
+	size_t available = client->input_len - client->input_pos;
+	char *input;
+	ssize_t nread;
+
+	emq_client_shrink(client, need);
+	available = client->input_len - client->input_pos;
+
+	if (client->input_pos && (client->input_len == client->input_size ||
+		client->input_pos + need > client->input_size)) {
+		memmove(client->input, client->input + client->input_pos, available);
+		client->input_pos = 0;
+		client->input_len = available;
+	}
+
+	if (need > EMQ_MAX_REQUEST_SIZE) {
+		return -1;
+	}
+
+	if (need > client->input_size) {
+		input = (char*)realloc(client->input, need);
+		if (!input) {
+			return -1;
+		}
+
+		client->input = input;
+		client->input_size = need;
+	}
+
+	if (client->input_len == client->input_size) {
+		return 0;
+	}
 
-	while ((ret = writev(client->fd, iov, iovcnt)) == -1 && errno == EINTR);
+	while ((nread = read(client->fd, client->input + client->input_len,
+		client->input_size - client->input_len)) == -1 && errno == EINTR);
 
-	return ret;
+	if (nread == -1) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+
+	if (nread == 0) {
+		return -1;
+	}
+
+	client->input_len += nread;
+
+	return nread;
+}
+
+int emq_client_write_some(emq_client *client, char *buf, int count)
+{
+	ssize_t nwritten;
+
+	while ((nwritten = write(client->fd, buf, count)) == -1 && errno == EINTR);
+
+	if (nwritten == -1) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+	}
+
+	return nwritten;
 }
 
 void emq_client_disconnect(emq_client *client)
 {
 	close(client->fd);
 }
+
+int emq_client_wait(emq_client *client, int timeout)
+{
+	if (client->input_len - client->input_pos) {
+		return 1;
+	}
+
+	return emq_client_poll(client, timeout);
+}
+
+int emq_client_poll(emq_client *client, int timeout)
+{
+	struct pollfd pfd;
+	int status;
+
+	pfd.fd = client->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	do {
+		status = poll(&pfd, 1, timeout);
+	} while (status == -1 && errno == EINTR);
+
+	return status;
+}
+
+long long emq_mstime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Absolute time for pthread_cond_timedwait, timeout milliseconds from now */
+void emq_deadline(struct timespec *ts, int timeout)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+
+	ts->tv_sec += timeout / 1000;
+	ts->tv_nsec += (long)(timeout % 1000) * 1000000;
+
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
@@ -29,17 +29,32 @@
 #define _EMQ_NETWORK_H_
 
 #include <sys/uio.h>
+#include <limits.h>
 
 #include "emq.h"
 
 #define EMQ_NET_OK 0
 #define EMQ_NET_ERR -1
 
+#if defined(IOV_MAX)
+	#define EMQ_IOV_MAX IOV_MAX
+#else
+	#define EMQ_IOV_MAX 1024
+#endif
+
 int emq_client_tcp_connect(emq_client *client, const char *addr, int port);
 int emq_client_unix_connect(emq_client *client, const char *path);
 int emq_client_read(emq_client *client, char *buf, int count);
+int emq_client_skip(emq_client *client, size_t count);
 int emq_client_write(emq_client *client, char *buf, int count);
 int emq_client_writev(emq_client *client, struct iovec *iov, int iovcnt);
+int emq_client_set_nonblock(emq_client *client, int nonblock);
+int emq_client_nonblocking(emq_client *client);
+int emq_client_fill(emq_client *client, size_t need);
+int emq_client_write_some(emq_client *client, char *buf, int count);
+int emq_client_wait(emq_client *client, int timeout);
+int emq_client_poll(emq_client *client, int timeout);
 void emq_client_disconnect(emq_client *client);
+long long emq_mstime(void);
 
 #endif
@@ -0,0 +1,369 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "emq.h"
+#include "pool.h"
+#include "network.h"
+#include "internal.h"
+
+#define EMQ_POOL_FREE 0
+#define EMQ_POOL_BUSY 1
+#define EMQ_POOL_CHECK 2
+#define EMQ_POOL_BROKEN 3
+
+typedef struct emq_pool_slot {
+	emq_client *client;
+	int state;
+	long long used;
+} emq_pool_slot;
+
+struct emq_pool {
+	char addr[256];
+	int port;
+	char name[32];
+	char password[32];
+	int auth;
+	emq_pool_slot *slots;
+	int size;
+	unsigned int next;
+	pthread_key_t sticky;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t timer;
+	int waiting;
+	int ping_interval;
+	pthread_t health;
+	int health_started;
+	int stop;
+};
+
+static emq_client *emq_pool_connect(emq_pool *pool)
+{
+	emq_client *client;
+
+	client = emq_tcp_connect(pool->addr, pool->port);
+	if (!client) {
+		return NULL;
+	}
+
+	if (pool->auth && emq_auth(client, pool->name, pool->password) == EMQ_STATUS_ERR) {
+		emq_disconnect(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+static int emq_pool_acquire_slot(emq_pool_slot *slot)
+{
+	int state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+
+	if (state != EMQ_POOL_FREE && state != EMQ_POOL_BROKEN) {
+		return 0;
+	}
+
+	return __atomic_compare_exchange_n(&slot->state, &state, EMQ_POOL_BUSY, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void emq_pool_release_slot(emq_pool *pool, emq_pool_slot *slot, int state)
+{
+	__atomic_store_n(&slot->state, state, __ATOMIC_SEQ_CST);
+
+	/* a broken slot can be taken too, it is reconnected by emq_pool_get */
+	if (__atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/* Tries the sticky connection of the thread first, then the other ones round robin */
+static emq_pool_slot *emq_pool_take(emq_pool *pool)
+{
+	intptr_t sticky = (intptr_t)pthread_getspecific(pool->sticky);
+	unsigned int start;
+	int i, index;
+
+	if (sticky && emq_pool_acquire_slot(&pool->slots[sticky - 1])) {
+		return &pool->slots[sticky - 1];
+	}
+
+	start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_SEQ_CST);
+
+	for (i = 0; i < pool->size; i++)
+	{
+		index = (int)((start + i) % pool->size);
+
+		if (emq_pool_acquire_slot(&pool->slots[index])) {
+			pthread_setspecific(pool->sticky, (void*)(intptr_t)(index + 1));
+			return &pool->slots[index];
+		}
+	}
+
+	return NULL;
+}
+
+static void emq_pool_check(emq_pool *pool, emq_pool_slot *slot, long long now)
+{
+	int state = __atomic_load_n(&slot->state, __ATOMIC_SEQ_CST);
+
+	if (state == EMQ_POOL_FREE && now - __atomic_load_n(&slot->used, __ATOMIC_SEQ_CST) < pool->ping_interval) {
+		return;
+	}
+
+	if ((state != EMQ_POOL_FREE && state != EMQ_POOL_BROKEN) ||
+		!__atomic_compare_exchange_n(&slot->state, &state, EMQ_POOL_CHECK, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		return;
+	}
+
+	if (slot->client && (emq_client_wait(slot->client, 0) != 0 || emq_ping(slot->client) == EMQ_STATUS_ERR)) {
+		emq_disconnect(slot->client);
+		__atomic_store_n(&slot->client, NULL, __ATOMIC_SEQ_CST);
+	}
+
+	if (!slot->client) {
+		__atomic_store_n(&slot->client, emq_pool_connect(pool), __ATOMIC_SEQ_CST);
+	}
+
+	__atomic_store_n(&slot->used, emq_mstime(), __ATOMIC_SEQ_CST);
+
+	emq_pool_release_slot(pool, slot, slot->client ? EMQ_POOL_FREE : EMQ_POOL_BROKEN);
+}
+
+static void *emq_pool_health(void *data)
+{
+	emq_pool *pool = (emq_pool*)data;
+	struct timespec deadline;
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (!pool->stop)
+	{
+		emq_deadline(&deadline, pool->ping_interval / 2 + 1);
+		pthread_cond_timedwait(&pool->timer, &pool->lock, &deadline);
+
+		if (pool->stop) {
+			break;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i = 0; i < pool->size; i++) {
+			emq_pool_check(pool, &pool->slots[i], emq_mstime());
+		}
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+emq_pool *emq_pool_create(const char *addr, int port, const char *name, const char *password,
+	int size, int ping_interval)
+{
+	emq_pool *pool;
+	int i;
+
+	if (size < 1 || strlen(addr) >= sizeof(pool->addr) ||
+		(name && (!password || strlen(name) >= sizeof(pool->name) || strlen(password) >= sizeof(pool->password)))) {
+		return NULL;
+	}
+
+	pool = (emq_pool*)calloc(1, sizeof(*pool));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->slots = (emq_pool_slot*)calloc(size, sizeof(emq_pool_slot));
+	if (!pool->slots) {
+		free(pool);
+		return NULL;
+	}
+
+	strcpy(pool->addr, addr);
+	pool->port = port;
+	pool->size = size;
+	pool->ping_interval = ping_interval;
+
+	if (name) {
+		strcpy(pool->name, name);
+		strcpy(pool->password, password);
+		pool->auth = 1;
+	}
+
+	if (pthread_key_create(&pool->sticky, NULL) != 0) {
+		free(pool->slots);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->timer, NULL);
+
+	for (i = 0; i < size; i++)
+	{
+		if ((pool->slots[i].client = emq_pool_connect(pool)) == NULL) {
+			goto error;
+		}
+
+		pool->slots[i].used = emq_mstime();
+	}
+
+	if (ping_interval > 0) {
+		if (pthread_create(&pool->health, NULL, emq_pool_health, pool) != 0) {
+			goto error;
+		}
+
+		pool->health_started = 1;
+	}
+
+	return pool;
+
+error:
+	emq_pool_release(pool);
+	return NULL;
+}
+
+void emq_pool_release(emq_pool *pool)
+{
+	int i;
+
+	if (pool->health_started) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->timer);
+		pthread_mutex_unlock(&pool->lock);
+
+		pthread_join(pool->health, NULL);
+	}
+
+	for (i = 0; i < pool->size; i++) {
+		if (pool->slots[i].client) {
+			emq_disconnect(pool->slots[i].client);
+		}
+	}
+
+	pthread_key_delete(pool->sticky);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	pthread_cond_destroy(&pool->timer);
+
+	free(pool->slots);
+	free(pool);
+}
+
+emq_client *emq_pool_get(emq_pool *pool, int timeout)
+{
+	struct timespec deadline;
+	emq_pool_slot *slot;
+	int status = 0;
+
+	if ((slot = emq_pool_take(pool)) == NULL && timeout != 0)
+	{
+		if (timeout > 0) {
+			emq_deadline(&deadline, timeout);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+
+		while ((slot = emq_pool_take(pool)) == NULL && status != ETIMEDOUT && !pool->stop) {
+			status = timeout > 0 ? pthread_cond_timedwait(&pool->cond, &pool->lock, &deadline) :
+				pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+
+		__atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (!slot) {
+		return NULL;
+	}
+
+	/* a broken connection is replaced on the way out */
+	if (!slot->client) {
+		__atomic_store_n(&slot->client, emq_pool_connect(pool), __ATOMIC_SEQ_CST);
+
+		if (!slot->client) {
+			emq_pool_release_slot(pool, slot, EMQ_POOL_BROKEN);
+			return NULL;
+		}
+	}
+
+	return slot->client;
+}
+
+void emq_pool_put(emq_pool *pool, emq_client *client)
+{
+	intptr_t sticky = (intptr_t)pthread_getspecific(pool->sticky);
+	emq_pool_slot *slot = NULL;
+	int i;
+
+	if (sticky && __atomic_load_n(&pool->slots[sticky - 1].client, __ATOMIC_SEQ_CST) == client) {
+		slot = &pool->slots[sticky - 1];
+	} else {
+		for (i = 0; i < pool->size && !slot; i++) {
+			if (__atomic_load_n(&pool->slots[i].client, __ATOMIC_SEQ_CST) == client) {
+				slot = &pool->slots[i];
+			}
+		}
+	}
+
+	if (!slot) {
+		return;
+	}
+
+	/* unread data or a closed socket mean that the connection can not be reused, and so does the
+	   state left by the borrower (outstanding prefetch pops, deferred confirms, noack mode,
+	   pipeline, subscriptions, message pool or dispatcher), the next one would inherit it */
+	if (client->prefetch || client->confirm || client->noack || client->window ||
+		emq_pipeline_active(client) || EMQ_DICT_LENGTH(client->queue_subscriptions) ||
+		EMQ_DICT_LENGTH(client->channel_subscriptions) || client->msg_pool || client->dispatch ||
+		client->inboxes || client->batches || client->drains || emq_client_wait(client, 0) != 0) {
+		emq_disconnect(client);
+		__atomic_store_n(&slot->client, NULL, __ATOMIC_SEQ_CST);
+		emq_pool_release_slot(pool, slot, EMQ_POOL_BROKEN);
+		return;
+	}
+
+	__atomic_store_n(&slot->used, emq_mstime(), __ATOMIC_SEQ_CST);
+	emq_pool_release_slot(pool, slot, EMQ_POOL_FREE);
+}
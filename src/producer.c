@@ -0,0 +1,702 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "emq.h"
+#include "producer.h"
+#include "network.h"
+#include "internal.h"
+
+#define strlenz(str) (strlen(str) + 1)
+
+#define EMQ_PRODUCER_MIN_BATCH 16
+#define EMQ_PRODUCER_SAMPLE_INTERVAL 250000
+#define EMQ_PRODUCER_RETRY_DELAY 100
+#define EMQ_PRODUCER_MAX_RETRY_DELAY 2000
+
+#define EMQ_PRODUCER_LOST(status) ((status) == EMQ_ERROR_WRITE || (status) == EMQ_ERROR_READ || \
+	(status) == EMQ_ERROR_RESPONSE)
+
+#define EMQ_PRODUCER_RING_AT(ring, index) ((ring)->records[((ring)->head + (index)) % (ring)->size])
+
+typedef struct emq_producer_queue emq_producer_queue;
+
+typedef struct emq_producer_record {
+	struct emq_producer_record *next;
+	emq_producer_queue *queue;
+	emq_msg *msg;
+	emq_producer_callback *callback;
+	void *arg;
+} emq_producer_record;
+
+struct emq_producer_queue {
+	char name[64];
+	emq_queue_handle *handle;
+	emq_producer_record *head;
+	emq_producer_record *tail;
+	size_t count;
+	size_t bytes;
+	long long first;
+	struct emq_producer_queue *next;
+};
+
+/* Frames written to the connection and not acknowledged yet, oldest first */
+typedef struct emq_producer_ring {
+	emq_producer_record **records;
+	int *statuses;
+	size_t size;
+	size_t head;
+	size_t count;
+	int retries;
+} emq_producer_ring;
+
+struct emq_producer {
+	emq_client *client;
+	emq_dict *names;
+	emq_producer_queue *queues;
+	emq_producer_ring ring;
+	size_t max_batch;
+	size_t max_bytes;
+	size_t limit;
+	int linger;
+	int flags;
+	size_t buffered;
+	size_t pending;
+	int flushing;
+	int started;
+	int stop;
+	double rtt;
+	double rate;
+	size_t pushed;
+	long long sampled;
+	long long probed;
+	emq_backoff backoff;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle;
+	pthread_t thread;
+};
+
+static long long emq_producer_ustime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * A batch should hold the messages that arrive during one round trip: smaller batches
+ * leave the connection idle, bigger ones only add latency.
+ */
+static void emq_producer_adapt(emq_producer *producer, long long now)
+{
+	double target;
+
+	if (now - producer->sampled >= EMQ_PRODUCER_SAMPLE_INTERVAL) {
+		target = (double)producer->pushed / (double)(now - producer->sampled);
+		producer->rate = producer->rate ? producer->rate * 0.75 + target * 0.25 : target;
+		producer->pushed = 0;
+		producer->sampled = now;
+	}
+
+	target = producer->rate * producer->rtt;
+
+	if (target < EMQ_PRODUCER_MIN_BATCH) {
+		target = EMQ_PRODUCER_MIN_BATCH;
+	}
+
+	producer->limit = target < (double)producer->max_batch ? (size_t)target : producer->max_batch;
+}
+
+static int emq_producer_full(emq_producer *producer, emq_producer_queue *queue)
+{
+	return queue->count >= producer->limit || (producer->max_bytes && queue->bytes >= producer->max_bytes);
+}
+
+static void emq_producer_ring_init(emq_producer_ring *ring, emq_producer_record **records, int *statuses,
+	size_t size, int retries)
+{
+	ring->records = records;
+	ring->statuses = statuses;
+	ring->size = size;
+	ring->head = 0;
+	ring->count = 0;
+	ring->retries = retries;
+}
+
+static void emq_producer_done(emq_producer *producer, size_t count)
+{
+	pthread_mutex_lock(&producer->lock);
+
+	producer->pending -= count;
+	if (!producer->pending) {
+		pthread_cond_broadcast(&producer->idle);
+	}
+
+	pthread_mutex_unlock(&producer->lock);
+}
+
+static void emq_producer_complete(emq_producer *producer, emq_producer_record *record, int status)
+{
+	if (record->callback) {
+		record->callback(producer, record->queue->name, record->msg, status, record->arg);
+	}
+
+	emq_msg_release(record->msg);
+	free(record);
+}
+
+/* Completes the oldest frames of the ring */
+static void emq_producer_shift(emq_producer *producer, size_t count, const int *statuses, int status)
+{
+	emq_producer_ring *ring = &producer->ring;
+	emq_producer_record *record;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		record = EMQ_PRODUCER_RING_AT(ring, 0);
+		ring->head = (ring->head + 1) % ring->size;
+		ring->count--;
+
+		emq_producer_complete(producer, record, statuses ? statuses[i] : status);
+	}
+
+	emq_producer_done(producer, count);
+}
+
+/*
+ * Writes the frames of the ring starting at the position as one pipeline. Acknowledged
+ * frames leave the ring, noacked ones stay in it until a barrier is answered.
+ */
+static int emq_producer_transmit(emq_producer *producer, size_t from)
+{
+	emq_producer_ring *ring = &producer->ring;
+	emq_client *client = producer->client;
+	emq_producer_record *record;
+	size_t count = ring->count - from;
+	long long start, rtt;
+	size_t i = 0;
+
+	/* the pipeline also writes the whole batch, so the round trip is probed with a ping from time to time */
+	start = emq_producer_ustime();
+
+	if (start - producer->probed >= EMQ_PRODUCER_SAMPLE_INTERVAL)
+	{
+		if (emq_ping(client) == EMQ_STATUS_ERR) {
+			return EMQ_ERROR_READ;
+		}
+
+		producer->probed = emq_producer_ustime();
+		rtt = producer->probed - start;
+
+		pthread_mutex_lock(&producer->lock);
+		producer->rtt = producer->rtt ? producer->rtt * 0.75 + (double)rtt * 0.25 : (double)rtt;
+		pthread_mutex_unlock(&producer->lock);
+	}
+
+	if (emq_pipeline_begin(client) == EMQ_STATUS_OK) {
+		client->noack = producer->flags & EMQ_PRODUCER_NOACK;
+
+		for (; i < count; i++) {
+			record = EMQ_PRODUCER_RING_AT(ring, from + i);
+			if (emq_queue_push_handle(client, record->queue->handle, record->msg) == EMQ_STATUS_ERR) {
+				break;
+			}
+		}
+
+		client->noack = 0;
+	}
+
+	if (i < count) {
+		emq_pipeline_discard(client);
+
+		for (i = 0; i < count; i++) {
+			record = EMQ_PRODUCER_RING_AT(ring, from + i);
+			emq_producer_complete(producer, record, EMQ_ERROR_ALLOC);
+		}
+
+		ring->count = from;
+		emq_producer_done(producer, count);
+		return EMQ_ERROR_NONE;
+	}
+
+	emq_pipeline_exec(client, ring->statuses);
+
+	for (i = 0; i < count && !EMQ_PRODUCER_LOST(ring->statuses[i]); i++);
+
+	if (!(producer->flags & EMQ_PRODUCER_NOACK)) {
+		emq_producer_shift(producer, i, ring->statuses, 0);
+	}
+
+	return i < count ? ring->statuses[i] : EMQ_ERROR_NONE;
+}
+
+static int emq_producer_recover(emq_producer *producer)
+{
+	struct timespec deadline;
+	int attempt, stop;
+
+	emq_backoff_reset(&producer->backoff);
+
+	for (attempt = 0; attempt != producer->ring.retries; attempt++)
+	{
+		if (emq_reconnect(producer->client) == EMQ_STATUS_OK) {
+			return EMQ_STATUS_OK;
+		}
+
+		pthread_mutex_lock(&producer->lock);
+
+		if (!producer->stop) {
+			emq_deadline(&deadline, (int)emq_backoff_next(&producer->backoff));
+			pthread_cond_timedwait(&producer->cond, &producer->lock, &deadline);
+		}
+
+		stop = producer->stop;
+		pthread_mutex_unlock(&producer->lock);
+
+		if (stop) {
+			break;
+		}
+	}
+
+	return EMQ_STATUS_ERR;
+}
+
+/*
+ * Sends the frames of the ring past the position and, when asked to, confirms noacked
+ * frames with a barrier. A lost connection is reconnected and everything past the last
+ * acknowledged frame is replayed, so a message may be delivered more than once.
+ */
+static void emq_producer_deliver(emq_producer *producer, size_t from, int sync)
+{
+	emq_producer_ring *ring = &producer->ring;
+	int noack = producer->flags & EMQ_PRODUCER_NOACK;
+	int error;
+
+	while (ring->count)
+	{
+		error = from < ring->count ? emq_producer_transmit(producer, from) : EMQ_ERROR_NONE;
+
+		if (error == EMQ_ERROR_NONE && noack) {
+			if (!sync) {
+				return;
+			}
+
+			if (emq_noack_sync(producer->client) == EMQ_STATUS_OK) {
+				emq_producer_shift(producer, ring->count, NULL, EMQ_ERROR_NONE);
+				return;
+			}
+
+			error = EMQ_ERROR_READ;
+		}
+
+		if (error == EMQ_ERROR_NONE) {
+			return;
+		}
+
+		if (emq_producer_recover(producer) == EMQ_STATUS_ERR) {
+			emq_producer_shift(producer, ring->count, NULL, error);
+			return;
+		}
+
+		from = 0;
+	}
+}
+
+/* Takes up to count records from the first queue that is full, lingered long enough or has to be flushed */
+static emq_producer_record *emq_producer_take(emq_producer *producer, size_t *count, int *wait)
+{
+	emq_producer_queue *queue;
+	emq_producer_record *head, *record;
+	long long now = emq_mstime();
+	size_t i;
+
+	*wait = -1;
+
+	for (queue = producer->queues; queue; queue = queue->next)
+	{
+		if (!queue->count) {
+			continue;
+		}
+
+		if (!emq_producer_full(producer, queue) && !producer->flushing && !producer->stop &&
+			now - queue->first < producer->linger) {
+			if (*wait == -1 || producer->linger - (now - queue->first) < *wait) {
+				*wait = (int)(producer->linger - (now - queue->first));
+			}
+			continue;
+		}
+
+		head = record = queue->head;
+
+		for (i = 1; i < *count && record->next; i++) {
+			queue->bytes -= record->msg->size;
+			record = record->next;
+		}
+
+		queue->bytes -= record->msg->size;
+		queue->head = record->next;
+		record->next = NULL;
+
+		if (!queue->head) {
+			queue->tail = NULL;
+		}
+
+		queue->count -= i;
+		producer->buffered -= i;
+		*count = i;
+
+		return head;
+	}
+
+	return NULL;
+}
+
+static void *emq_producer_flusher(void *data)
+{
+	emq_producer *producer = (emq_producer*)data;
+	emq_producer_ring *ring = &producer->ring;
+	emq_producer_record *record, *next;
+	struct timespec deadline;
+	size_t count, from;
+	int wait;
+
+	pthread_mutex_lock(&producer->lock);
+
+	while (1)
+	{
+		emq_producer_adapt(producer, emq_producer_ustime());
+
+		/* a full ring of noacked frames has to be confirmed before anything else is written */
+		if (ring->count == ring->size) {
+			pthread_mutex_unlock(&producer->lock);
+			emq_producer_deliver(producer, ring->count, 1);
+			pthread_mutex_lock(&producer->lock);
+			continue;
+		}
+
+		count = ring->size - ring->count;
+		if (count > producer->max_batch) {
+			count = producer->max_batch;
+		}
+
+		if ((record = emq_producer_take(producer, &count, &wait)) != NULL) {
+			pthread_mutex_unlock(&producer->lock);
+
+			for (from = ring->count; record; record = next) {
+				next = record->next;
+				EMQ_PRODUCER_RING_AT(ring, ring->count++) = record;
+			}
+
+			emq_producer_deliver(producer, from, 0);
+			pthread_mutex_lock(&producer->lock);
+			continue;
+		}
+
+		/* nothing is ready to be sent, so the noacked frames are confirmed now */
+		if (ring->count) {
+			pthread_mutex_unlock(&producer->lock);
+			emq_producer_deliver(producer, ring->count, 1);
+			pthread_mutex_lock(&producer->lock);
+			continue;
+		}
+
+		if (producer->stop) {
+			break;
+		}
+
+		if (wait == -1) {
+			pthread_cond_wait(&producer->cond, &producer->lock);
+		} else {
+			emq_deadline(&deadline, wait);
+			pthread_cond_timedwait(&producer->cond, &producer->lock, &deadline);
+		}
+	}
+
+	pthread_mutex_unlock(&producer->lock);
+
+	return NULL;
+}
+
+static void emq_producer_queue_release(void *value)
+{
+	emq_producer_queue *queue = (emq_producer_queue*)value;
+
+	emq_queue_handle_release(queue->handle);
+	free(queue);
+}
+
+emq_producer *emq_producer_create(emq_client *client, size_t batch, size_t bytes, int linger, int flags)
+{
+	emq_producer_record **records = NULL;
+	emq_producer *producer;
+	int *statuses = NULL;
+
+	EMQ_CLEAR_ERROR(client);
+
+	/* events can not be told apart from the responses read by the flusher */
+	if (batch < 1 || linger < 0 ||
+		EMQ_DICT_LENGTH(client->queue_subscriptions) || EMQ_DICT_LENGTH(client->channel_subscriptions)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return NULL;
+	}
+
+	producer = (emq_producer*)calloc(1, sizeof(*producer));
+	if (!producer) {
+		goto error_alloc;
+	}
+
+	records = (emq_producer_record**)malloc(sizeof(emq_producer_record*) * batch);
+	statuses = (int*)malloc(sizeof(int) * batch);
+	producer->names = emq_dict_init();
+
+	if (!records || !statuses || !producer->names) {
+		goto error_free;
+	}
+
+	producer->names->free = emq_producer_queue_release;
+
+	/* without retransmission the ring only holds the batch being written */
+	emq_producer_ring_init(&producer->ring, records, statuses, batch, 0);
+
+	producer->client = client;
+	producer->max_batch = batch;
+	producer->max_bytes = bytes;
+	producer->limit = batch;
+	producer->linger = linger;
+	producer->flags = flags;
+	producer->sampled = emq_producer_ustime();
+
+	emq_backoff_init(&producer->backoff, EMQ_PRODUCER_RETRY_DELAY, EMQ_PRODUCER_MAX_RETRY_DELAY,
+		(uint32_t)producer->sampled ^ (uint32_t)(uintptr_t)producer);
+
+	pthread_mutex_init(&producer->lock, NULL);
+	pthread_cond_init(&producer->cond, NULL);
+	pthread_cond_init(&producer->idle, NULL);
+
+	if (pthread_create(&producer->thread, NULL, emq_producer_flusher, producer) != 0) {
+		pthread_mutex_destroy(&producer->lock);
+		pthread_cond_destroy(&producer->cond);
+		pthread_cond_destroy(&producer->idle);
+		goto error_free;
+	}
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return producer;
+
+error_free:
+	if (producer->names) {
+		emq_dict_release(producer->names);
+	}
+	free(records);
+	free(statuses);
+	free(producer);
+
+error_alloc:
+	emq_client_set_error(client, EMQ_ERROR_ALLOC);
+	EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+	return NULL;
+}
+
+void emq_producer_release(emq_producer *producer)
+{
+	pthread_mutex_lock(&producer->lock);
+	producer->stop = 1;
+	pthread_cond_signal(&producer->cond);
+	pthread_mutex_unlock(&producer->lock);
+
+	pthread_join(producer->thread, NULL);
+
+	pthread_mutex_destroy(&producer->lock);
+	pthread_cond_destroy(&producer->cond);
+	pthread_cond_destroy(&producer->idle);
+
+	emq_dict_release(producer->names);
+	emq_disconnect(producer->client);
+
+	free(producer->ring.records);
+	free(producer->ring.statuses);
+	free(producer);
+}
+
+emq_client *emq_producer_client(emq_producer *producer)
+{
+	return producer->client;
+}
+
+int emq_producer_retransmit(emq_producer *producer, size_t size, int retries)
+{
+	emq_producer_record **records;
+	int *statuses;
+
+	/* -1 retries forever, any other negative count would do the same unnoticed */
+	if (size < 1 || retries < -1) {
+		return EMQ_ERROR_DATA;
+	}
+
+	records = (emq_producer_record**)malloc(sizeof(emq_producer_record*) * size);
+	statuses = (int*)malloc(sizeof(int) * size);
+
+	if (!records || !statuses) {
+		free(records);
+		free(statuses);
+		return EMQ_ERROR_ALLOC;
+	}
+
+	pthread_mutex_lock(&producer->lock);
+
+	/* the ring belongs to the flusher once the first message is pushed */
+	if (producer->started || producer->stop) {
+		pthread_mutex_unlock(&producer->lock);
+		free(records);
+		free(statuses);
+		return EMQ_ERROR_DATA;
+	}
+
+	free(producer->ring.records);
+	free(producer->ring.statuses);
+
+	emq_producer_ring_init(&producer->ring, records, statuses, size, retries);
+
+	pthread_mutex_unlock(&producer->lock);
+
+	return EMQ_ERROR_NONE;
+}
+
+static emq_producer_queue *emq_producer_queue_get(emq_producer *producer, const char *name)
+{
+	emq_producer_queue *queue;
+	emq_dict_entry *entry;
+
+	entry = emq_dict_find(producer->names, name, emq_dict_hash(name));
+	if (entry) {
+		return (emq_producer_queue*)entry->value;
+	}
+
+	queue = (emq_producer_queue*)calloc(1, sizeof(*queue));
+	if (!queue) {
+		return NULL;
+	}
+
+	strcpy(queue->name, name);
+
+	if ((queue->handle = emq_queue_handle_create(name)) == NULL) {
+		free(queue);
+		return NULL;
+	}
+
+	if (emq_dict_add(producer->names, queue->name, queue) == EMQ_STATUS_ERR) {
+		emq_producer_queue_release(queue);
+		return NULL;
+	}
+
+	queue->next = producer->queues;
+	producer->queues = queue;
+
+	return queue;
+}
+
+int emq_producer_push(emq_producer *producer, const char *name, emq_msg *msg,
+	emq_producer_callback *callback, void *arg)
+{
+	emq_producer_queue *queue;
+	emq_producer_record *record;
+
+	if (strlenz(name) > sizeof(queue->name) || msg->size < 1) {
+		return EMQ_ERROR_DATA;
+	}
+
+	record = (emq_producer_record*)malloc(sizeof(*record));
+	if (!record) {
+		return EMQ_ERROR_ALLOC;
+	}
+
+	record->next = NULL;
+	record->msg = msg;
+	record->callback = callback;
+	record->arg = arg;
+
+	pthread_mutex_lock(&producer->lock);
+
+	if (producer->stop || (queue = emq_producer_queue_get(producer, name)) == NULL) {
+		pthread_mutex_unlock(&producer->lock);
+		free(record);
+		return producer->stop ? EMQ_ERROR_DATA : EMQ_ERROR_ALLOC;
+	}
+
+	emq_msg_ref(msg);
+	record->queue = queue;
+
+	if (queue->tail) {
+		queue->tail->next = record;
+	} else {
+		queue->head = record;
+		queue->first = emq_mstime();
+	}
+
+	queue->tail = record;
+	queue->count++;
+	queue->bytes += msg->size;
+
+	producer->pushed++;
+	producer->pending++;
+	producer->started = 1;
+
+	/* the flusher sleeps without a deadline while nothing is buffered */
+	if (!producer->buffered++ || emq_producer_full(producer, queue)) {
+		pthread_cond_signal(&producer->cond);
+	}
+
+	pthread_mutex_unlock(&producer->lock);
+
+	return EMQ_ERROR_NONE;
+}
+
+void emq_producer_flush(emq_producer *producer)
+{
+	pthread_mutex_lock(&producer->lock);
+
+	producer->flushing++;
+	pthread_cond_signal(&producer->cond);
+
+	while (producer->pending) {
+		pthread_cond_wait(&producer->idle, &producer->lock);
+	}
+
+	producer->flushing--;
+
+	pthread_mutex_unlock(&producer->lock);
+}
@@ -0,0 +1,51 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _EMQ_PRODUCER_H_
+#define _EMQ_PRODUCER_H_
+
+#include "emq.h"
+
+#define EMQ_DEFAULT_PRODUCER_BATCH 256
+#define EMQ_DEFAULT_PRODUCER_LINGER 5
+
+#define EMQ_PRODUCER_NOACK 1
+
+typedef struct emq_producer emq_producer;
+
+typedef void emq_producer_callback(emq_producer *producer, const char *name, emq_msg *msg, int status, void *arg);
+
+emq_producer *emq_producer_create(emq_client *client, size_t batch, size_t bytes, int linger, int flags);
+void emq_producer_release(emq_producer *producer);
+emq_client *emq_producer_client(emq_producer *producer);
+int emq_producer_retransmit(emq_producer *producer, size_t size, int retries);
+
+int emq_producer_push(emq_producer *producer, const char *name, emq_msg *msg,
+	emq_producer_callback *callback, void *arg);
+void emq_producer_flush(emq_producer *producer);
+
+#endif
@@ -483,6 +483,16 @@ typedef struct protocol_response_channel_exist {
 	} body;
 } protocol_response_channel_exist;
 
+typedef struct protocol_event_queue {
+	char name[64];
+} protocol_event_queue;
+
+typedef struct protocol_event_channel {
+	char name[64];
+	char topic[32];
+	char pattern[32];
+} protocol_event_channel;
+
 #pragma pack(pop)
 
 #endif
@@ -0,0 +1,574 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "emq.h"
+#include "shared.h"
+#include "network.h"
+#include "packet.h"
+#include "protocol.h"
+#include "internal.h"
+
+#define strlenz(str) (strlen(str) + 1)
+
+#define EMQ_SHARED_IOV_SIZE 256
+
+typedef struct emq_shared_request {
+	struct emq_shared_request *next;
+	union {
+		protocol_request_header header;
+		protocol_request_queue_size queue_size;
+		protocol_request_queue_push queue_push;
+		protocol_request_queue_get queue_get;
+		protocol_request_queue_pop queue_pop;
+		protocol_request_queue_confirm queue_confirm;
+		protocol_request_route_push route_push;
+		protocol_request_channel_publish channel_publish;
+	} packet;
+	emq_time expire;
+	struct iovec iov[2 + EMQ_MSG_IOV_MAX];
+	int iovcnt;
+	int status;
+	emq_msg *msg;
+	uint32_t value;
+	int done;
+} emq_shared_request;
+
+struct emq_shared {
+	emq_client *client;
+	emq_shared_request *submit;
+	pthread_mutex_t write_lock;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	emq_shared_request *head;
+	emq_shared_request *tail;
+	int reading;
+	int broken;
+};
+
+emq_shared *emq_shared_create(emq_client *client)
+{
+	emq_shared *shared;
+
+	EMQ_CLEAR_ERROR(client);
+
+	/* the message pool is not thread-safe, events can not be told apart from responses and
+	   the per-client state (prefetch, deferred confirms, noack window, pipeline) would be
+	   touched from several threads; the shared methods also expect blocking I/O */
+	if (client->msg_pool || EMQ_DICT_LENGTH(client->queue_subscriptions) ||
+		EMQ_DICT_LENGTH(client->channel_subscriptions) || client->prefetch || client->confirm ||
+		client->window || client->drains || client->batches || emq_pipeline_active(client) ||
+		emq_client_nonblocking(client)) {
+		emq_client_set_error(client, EMQ_ERROR_DATA);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return NULL;
+	}
+
+	shared = (emq_shared*)calloc(1, sizeof(*shared));
+	if (!shared) {
+		emq_client_set_error(client, EMQ_ERROR_ALLOC);
+		EMQ_SET_STATUS(client, EMQ_STATUS_ERR);
+		return NULL;
+	}
+
+	shared->client = client;
+
+	pthread_mutex_init(&shared->write_lock, NULL);
+	pthread_mutex_init(&shared->lock, NULL);
+	pthread_cond_init(&shared->cond, NULL);
+
+	EMQ_SET_STATUS(client, EMQ_STATUS_OK);
+	return shared;
+}
+
+void emq_shared_release(emq_shared *shared)
+{
+	pthread_mutex_destroy(&shared->write_lock);
+	pthread_mutex_destroy(&shared->lock);
+	pthread_cond_destroy(&shared->cond);
+
+	emq_disconnect(shared->client);
+	free(shared);
+}
+
+emq_client *emq_shared_client(emq_shared *shared)
+{
+	return shared->client;
+}
+
+static void emq_shared_request_init(emq_shared_request *request, uint8_t cmd, size_t size, uint32_t bodylen)
+{
+	memset(request, 0, sizeof(*request));
+
+	request->packet.header.magic = EMQ_PROTOCOL_REQ;
+	request->packet.header.cmd = cmd;
+	request->packet.header.noack = 0;
+	request->packet.header.bodylen = bodylen;
+
+	request->iov[0].iov_base = &request->packet;
+	request->iov[0].iov_len = size;
+	request->iovcnt = 1;
+}
+
+static void emq_shared_request_msg(emq_shared_request *request, emq_msg *msg, int expire)
+{
+	if (expire) {
+		request->expire = msg->expire;
+		request->iov[request->iovcnt].iov_base = &request->expire;
+		request->iov[request->iovcnt].iov_len = sizeof(request->expire);
+		request->iovcnt++;
+	}
+
+	request->iovcnt += emq_msg_iov(msg, request->iov + request->iovcnt);
+}
+
+/* Completes every request waiting for a response, the lock must be held */
+static void emq_shared_fail(emq_shared *shared, int status)
+{
+	emq_shared_request *request;
+
+	shared->broken = 1;
+
+	while ((request = shared->head) != NULL) {
+		shared->head = request->next;
+		request->status = status;
+		request->done = 1;
+	}
+
+	shared->tail = NULL;
+
+	pthread_cond_broadcast(&shared->cond);
+}
+
+static void emq_shared_submit(emq_shared *shared, emq_shared_request *request)
+{
+	emq_shared_request *head = __atomic_load_n(&shared->submit, __ATOMIC_SEQ_CST);
+
+	do {
+		request->next = head;
+	} while (!__atomic_compare_exchange_n(&shared->submit, &head, request, 0,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+}
+
+static int emq_shared_writev(emq_shared *shared, struct iovec *iov, int iovcnt)
+{
+	return iovcnt ? emq_client_writev(shared->client, iov, iovcnt) : 0;
+}
+
+/* Writes the submitted requests of all threads with shared writev calls. A thread which finds
+   the writer busy leaves its request to the writer, which checks the queue again after unlocking */
+static void emq_shared_write(emq_shared *shared)
+{
+	struct iovec iov[EMQ_SHARED_IOV_SIZE];
+	emq_shared_request *batch, *request, *next, *last;
+	int iovcnt, status;
+
+	while (__atomic_load_n(&shared->submit, __ATOMIC_SEQ_CST) != NULL)
+	{
+		if (pthread_mutex_trylock(&shared->write_lock) != 0) {
+			return;
+		}
+
+		batch = __atomic_exchange_n(&shared->submit, NULL, __ATOMIC_SEQ_CST);
+
+		/* the submission stack holds the newest request first */
+		for (last = batch, request = NULL; batch; batch = next) {
+			next = batch->next;
+			batch->next = request;
+			request = batch;
+		}
+
+		batch = request;
+
+		pthread_mutex_lock(&shared->lock);
+
+		if (shared->broken) {
+			for (request = batch; request; request = next) {
+				next = request->next;
+				request->status = EMQ_ERROR_WRITE;
+				request->done = 1;
+			}
+
+			pthread_cond_broadcast(&shared->cond);
+			batch = NULL;
+		} else if (batch) {
+			if (shared->tail) {
+				shared->tail->next = batch;
+			} else {
+				shared->head = batch;
+			}
+
+			shared->tail = last;
+		}
+
+		pthread_mutex_unlock(&shared->lock);
+
+		status = 0;
+		iovcnt = 0;
+
+		/* a written request may be completed and released by its thread at any moment */
+		for (request = batch; request && status != -1; request = next)
+		{
+			next = request->next;
+
+			if (iovcnt + request->iovcnt > EMQ_SHARED_IOV_SIZE) {
+				status = emq_shared_writev(shared, iov, iovcnt);
+				iovcnt = 0;
+			}
+
+			memcpy(iov + iovcnt, request->iov, sizeof(*iov) * request->iovcnt);
+			iovcnt += request->iovcnt;
+		}
+
+		if (status != -1) {
+			status = emq_shared_writev(shared, iov, iovcnt);
+		}
+
+		if (status == -1) {
+			pthread_mutex_lock(&shared->lock);
+			emq_shared_fail(shared, EMQ_ERROR_WRITE);
+			pthread_mutex_unlock(&shared->lock);
+		}
+
+		pthread_mutex_unlock(&shared->write_lock);
+	}
+}
+
+/* Returns EMQ_ERROR_* of the response or -1 if the connection is broken */
+static int emq_shared_response(emq_shared *shared, emq_shared_request *request,
+	protocol_response_header *header)
+{
+	emq_client *client = shared->client;
+	uint64_t tag;
+	emq_msg *msg;
+	int code;
+
+	if (emq_check_response_header_mini(header, request->packet.header.cmd) == EMQ_STATUS_ERR) {
+		return -1;
+	}
+
+	if (emq_check_status(header, EMQ_PROTOCOL_STATUS_SUCCESS) == EMQ_STATUS_ERR) {
+		if (emq_client_skip(client, header->bodylen) == -1) {
+			return -1;
+		}
+
+		code = emq_get_error(header);
+		return (code == EMQ_ERROR_NONE) ? EMQ_ERROR_RESPONSE : code;
+	}
+
+	switch (header->cmd)
+	{
+		case EMQ_PROTOCOL_CMD_QUEUE_GET:
+		case EMQ_PROTOCOL_CMD_QUEUE_POP:
+			if (header->bodylen < sizeof(tag) || emq_client_read(client, (char*)&tag, sizeof(tag)) == -1) {
+				return -1;
+			}
+
+			msg = emq_msg_pool_alloc(NULL, header->bodylen - sizeof(tag));
+			if (!msg) {
+				return emq_client_skip(client, header->bodylen - sizeof(tag)) == -1 ? -1 : EMQ_ERROR_ALLOC;
+			}
+
+			if (emq_client_read(client, (char*)msg->data, msg->size) == -1) {
+				emq_msg_release(msg);
+				return -1;
+			}
+
+			msg->tag = tag;
+			request->msg = msg;
+			break;
+
+		case EMQ_PROTOCOL_CMD_QUEUE_SIZE:
+			if (header->bodylen != sizeof(request->value) ||
+				emq_client_read(client, (char*)&request->value, sizeof(request->value)) == -1) {
+				return -1;
+			}
+			break;
+
+		default:
+			if (emq_client_skip(client, header->bodylen) == -1) {
+				return -1;
+			}
+	}
+
+	return EMQ_ERROR_NONE;
+}
+
+/* Reads responses in order and completes the waiters until the own request is done */
+static void emq_shared_read(emq_shared *shared, emq_shared_request *self)
+{
+	protocol_response_header header;
+	emq_shared_request *request;
+	int status, done;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&shared->lock);
+		done = self->done;
+		pthread_mutex_unlock(&shared->lock);
+
+		if (done) {
+			return;
+		}
+
+		request = NULL;
+
+		if (emq_client_read(shared->client, (char*)&header, sizeof(header)) == -1) {
+			status = EMQ_ERROR_READ;
+			goto error;
+		}
+
+		if (header.magic == EMQ_PROTOCOL_EVENT) {
+			if (emq_client_skip(shared->client, header.bodylen) == -1) {
+				status = EMQ_ERROR_READ;
+				goto error;
+			}
+			continue;
+		}
+
+		pthread_mutex_lock(&shared->lock);
+
+		if ((request = shared->head) != NULL) {
+			shared->head = request->next;
+			if (!shared->head) {
+				shared->tail = NULL;
+			}
+		}
+
+		pthread_mutex_unlock(&shared->lock);
+
+		if (!request) {
+			status = EMQ_ERROR_RESPONSE;
+			goto error;
+		}
+
+		if ((status = emq_shared_response(shared, request, &header)) == -1) {
+			status = EMQ_ERROR_READ;
+			goto error;
+		}
+
+		pthread_mutex_lock(&shared->lock);
+		request->status = status;
+		request->done = 1;
+		pthread_cond_broadcast(&shared->cond);
+		pthread_mutex_unlock(&shared->lock);
+	}
+
+error:
+	/* the writer may still use the iovecs of the queued requests */
+	pthread_mutex_lock(&shared->write_lock);
+	pthread_mutex_lock(&shared->lock);
+
+	if (request) {
+		request->status = status;
+		request->done = 1;
+	}
+
+	emq_shared_fail(shared, status);
+
+	pthread_mutex_unlock(&shared->lock);
+	pthread_mutex_unlock(&shared->write_lock);
+}
+
+static int emq_shared_execute(emq_shared *shared, emq_shared_request *request)
+{
+	emq_shared_submit(shared, request);
+	emq_shared_write(shared);
+
+	pthread_mutex_lock(&shared->lock);
+
+	while (!request->done)
+	{
+		if (shared->reading || shared->broken) {
+			pthread_cond_wait(&shared->cond, &shared->lock);
+			continue;
+		}
+
+		shared->reading = 1;
+		pthread_mutex_unlock(&shared->lock);
+
+		emq_shared_read(shared, request);
+
+		pthread_mutex_lock(&shared->lock);
+		shared->reading = 0;
+		pthread_cond_broadcast(&shared->cond);
+	}
+
+	pthread_mutex_unlock(&shared->lock);
+
+	return request->status;
+}
+
+int emq_shared_ping(emq_shared *shared)
+{
+	emq_shared_request request;
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_PING, sizeof(request.packet.header), 0);
+
+	return emq_shared_execute(shared, &request);
+}
+
+int emq_shared_queue_size(emq_shared *shared, const char *name, uint32_t *size)
+{
+	emq_shared_request request;
+	int status;
+
+	if (strlenz(name) > sizeof(request.packet.queue_size.body.name)) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_QUEUE_SIZE, sizeof(request.packet.queue_size),
+		sizeof(request.packet.queue_size.body));
+	memcpy(request.packet.queue_size.body.name, name, strlenz(name));
+
+	if ((status = emq_shared_execute(shared, &request)) == EMQ_ERROR_NONE) {
+		*size = request.value;
+	}
+
+	return status;
+}
+
+int emq_shared_queue_push(emq_shared *shared, const char *name, emq_msg *msg)
+{
+	emq_shared_request request;
+
+	if (strlenz(name) > sizeof(request.packet.queue_push.body.name) ||
+		!EMQ_MSG_SIZE_VALID(msg, sizeof(request.packet.queue_push.body) + sizeof(msg->expire))) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_QUEUE_PUSH, sizeof(request.packet.queue_push),
+		sizeof(request.packet.queue_push.body) + sizeof(msg->expire) + msg->size);
+	memcpy(request.packet.queue_push.body.name, name, strlenz(name));
+	emq_shared_request_msg(&request, msg, 1);
+
+	return emq_shared_execute(shared, &request);
+}
+
+int emq_shared_queue_get(emq_shared *shared, const char *name, emq_msg **msg)
+{
+	emq_shared_request request;
+	int status;
+
+	*msg = NULL;
+
+	if (strlenz(name) > sizeof(request.packet.queue_get.body.name)) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_QUEUE_GET, sizeof(request.packet.queue_get),
+		sizeof(request.packet.queue_get.body));
+	memcpy(request.packet.queue_get.body.name, name, strlenz(name));
+
+	if ((status = emq_shared_execute(shared, &request)) == EMQ_ERROR_NONE) {
+		*msg = request.msg;
+	}
+
+	return status;
+}
+
+int emq_shared_queue_pop(emq_shared *shared, const char *name, emq_time timeout, emq_msg **msg)
+{
+	emq_shared_request request;
+	int status;
+
+	*msg = NULL;
+
+	if (strlenz(name) > sizeof(request.packet.queue_pop.body.name)) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_QUEUE_POP, sizeof(request.packet.queue_pop),
+		sizeof(request.packet.queue_pop.body));
+	memcpy(request.packet.queue_pop.body.name, name, strlenz(name));
+	request.packet.queue_pop.body.timeout = timeout;
+
+	if ((status = emq_shared_execute(shared, &request)) == EMQ_ERROR_NONE) {
+		*msg = request.msg;
+	}
+
+	return status;
+}
+
+int emq_shared_queue_confirm(emq_shared *shared, const char *name, emq_tag tag)
+{
+	emq_shared_request request;
+
+	if (strlenz(name) > sizeof(request.packet.queue_confirm.body.name)) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_QUEUE_CONFIRM, sizeof(request.packet.queue_confirm),
+		sizeof(request.packet.queue_confirm.body));
+	memcpy(request.packet.queue_confirm.body.name, name, strlenz(name));
+	request.packet.queue_confirm.body.tag = tag;
+
+	return emq_shared_execute(shared, &request);
+}
+
+int emq_shared_route_push(emq_shared *shared, const char *name, const char *key, emq_msg *msg)
+{
+	emq_shared_request request;
+
+	if (strlenz(name) > sizeof(request.packet.route_push.body.name) ||
+		strlenz(key) > sizeof(request.packet.route_push.body.key) ||
+		!EMQ_MSG_SIZE_VALID(msg, sizeof(request.packet.route_push.body) + sizeof(msg->expire))) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_ROUTE_PUSH, sizeof(request.packet.route_push),
+		sizeof(request.packet.route_push.body) + sizeof(msg->expire) + msg->size);
+	memcpy(request.packet.route_push.body.name, name, strlenz(name));
+	memcpy(request.packet.route_push.body.key, key, strlenz(key));
+	emq_shared_request_msg(&request, msg, 1);
+
+	return emq_shared_execute(shared, &request);
+}
+
+int emq_shared_channel_publish(emq_shared *shared, const char *name, const char *topic, emq_msg *msg)
+{
+	emq_shared_request request;
+
+	if (strlenz(name) > sizeof(request.packet.channel_publish.body.name) ||
+		strlenz(topic) > sizeof(request.packet.channel_publish.body.topic) ||
+		!EMQ_MSG_SIZE_VALID(msg, sizeof(request.packet.channel_publish.body))) {
+		return EMQ_ERROR_DATA;
+	}
+
+	emq_shared_request_init(&request, EMQ_PROTOCOL_CMD_CHANNEL_PUBLISH, sizeof(request.packet.channel_publish),
+		sizeof(request.packet.channel_publish.body) + msg->size);
+	memcpy(request.packet.channel_publish.body.name, name, strlenz(name));
+	memcpy(request.packet.channel_publish.body.topic, topic, strlenz(topic));
+	emq_shared_request_msg(&request, msg, 0);
+
+	return emq_shared_execute(shared, &request);
+}
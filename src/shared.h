@@ -0,0 +1,48 @@
+/*
+   Copyright (c) 2012, Stanislav Yakush(st.yakush@yandex.ru)
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the libemq nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER BE LIABLE FOR ANY
+   DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _EMQ_SHARED_H_
+#define _EMQ_SHARED_H_
+
+#include "emq.h"
+
+typedef struct emq_shared emq_shared;
+
+emq_shared *emq_shared_create(emq_client *client);
+void emq_shared_release(emq_shared *shared);
+emq_client *emq_shared_client(emq_shared *shared);
+
+int emq_shared_ping(emq_shared *shared);
+int emq_shared_queue_size(emq_shared *shared, const char *name, uint32_t *size);
+int emq_shared_queue_push(emq_shared *shared, const char *name, emq_msg *msg);
+int emq_shared_queue_get(emq_shared *shared, const char *name, emq_msg **msg);
+int emq_shared_queue_pop(emq_shared *shared, const char *name, emq_time timeout, emq_msg **msg);
+int emq_shared_queue_confirm(emq_shared *shared, const char *name, emq_tag tag);
+int emq_shared_route_push(emq_shared *shared, const char *name, const char *key, emq_msg *msg);
+int emq_shared_channel_publish(emq_shared *shared, const char *name, const char *topic, emq_msg *msg);
+
+#endif